@@ -253,4 +253,18 @@ bool CSHA1::GetHash(UINT_8* pbDest20) const
 	return true;
 }
 
+void CSHA1::GetState(SHA1_STATE& stDest) const
+{
+	memcpy(stDest.state, m_state, sizeof(m_state));
+	memcpy(stDest.count, m_count, sizeof(m_count));
+	memcpy(stDest.buffer, m_buffer, sizeof(m_buffer));
+}
+
+void CSHA1::SetState(const SHA1_STATE& stSrc)
+{
+	memcpy(m_state, stSrc.state, sizeof(m_state));
+	memcpy(m_count, stSrc.count, sizeof(m_count));
+	memcpy(m_buffer, stSrc.buffer, sizeof(m_buffer));
+}
+
 #pragma warning(pop)
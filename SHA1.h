@@ -218,6 +218,14 @@ typedef union
 	UINT_32 l[16];
 } SHA1_WORKSPACE_BLOCK;
 
+// Intermediate hash state, allows to suspend hashing and resume it later
+typedef struct
+{
+	UINT_32 state[5];
+	UINT_32 count[2];
+	UINT_8 buffer[64];
+} SHA1_STATE;
+
 class CSHA1
 {
 public:
@@ -263,6 +271,10 @@ public:
 	// Get the raw message digest (20 bytes)
 	bool GetHash(UINT_8* pbDest20) const;
 
+	// Save and restore intermediate hash state (before Final)
+	void GetState(SHA1_STATE& stDest) const;
+	void SetState(const SHA1_STATE& stSrc);
+
 private:
 	// Private SHA-1 transformation
 	void Transform(UINT_32* pState, const UINT_8* pBuffer);
@@ -1,4 +1,6 @@
 #include "async_manager.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 
 #include <deque>
 #include <map>
@@ -89,6 +91,8 @@ namespace
 
 	void worker()
 	{
+		TRACE_THREAD_NAME("worker");
+
 		while(true)
 		{
 			AsyncManager::Task task;
@@ -113,19 +117,19 @@ namespace
 						task.swap(t.task);
 						group.swap(t.group);
 
-						// add it to the corresponding group
-						s_groups[group].tasks += 1;
-
 						if(t.started)
 						{
 							t.started->set();
 						}
 
 						s_asyncQueue.pop_front();
+						Stats::adjust(Stats::AsyncQueueDepth, -1);
 
 						break;
 					}
 
+					TRACE_SCOPE("worker idle");
+					Stats::Timer timer(Stats::WorkerWaitTime);
 					s_asyncWorkerAttention.wait(lock);
 				}
 			}
@@ -187,9 +191,18 @@ namespace
 
 	void syncTask(std::unique_lock<std::mutex>& lock, Group& group)
 	{
+		Stats::Timer timer(Stats::SyncWaitTime);
 		group.waiters += 1;
-		while(!group.wait_for(lock, std::chrono::milliseconds(100)))
+		while(true)
 		{
+			{
+				TRACE_SCOPE("sync wait");
+				if(group.wait_for(lock, std::chrono::milliseconds(100)))
+				{
+					break;
+				}
+			}
+
 			asyncTick(lock);
 		}
 		group.waiters -= 1;
@@ -236,6 +249,13 @@ namespace AsyncManager
 
 		std::unique_lock<std::mutex> lock(s_asyncMutex);
 
+		Stats::add(Stats::AsyncTasks);
+		Stats::adjust(Stats::AsyncQueueDepth, 1);
+
+		// count the task in its group right away, so sync() waits for queued
+		// tasks as well
+		s_groups[group].tasks += 1;
+
 		if(allowQueue)
 		{
 			s_asyncQueue.emplace_back(task, group, nullptr);
@@ -246,6 +266,9 @@ namespace AsyncManager
 			Event started;
 			s_asyncQueue.emplace_back(task, group, &started);
 			s_asyncWorkerAttention.notify_one();
+
+			TRACE_SCOPE("async blocked");
+			Stats::Timer timer(Stats::AsyncBlockedTime);
 			started.wait(lock);
 		}
 	}
@@ -309,6 +332,9 @@ namespace AsyncManager
 				s_syncQueue.pop_front();
 			}
 
+			Stats::add(Stats::SyncTasks);
+
+			TRACE_SCOPE("sync drain");
 			task();
 		}
 	}
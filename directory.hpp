@@ -3,6 +3,7 @@
 
 
 #include <stddef.h> // for size_t
+#include <stdint.h>
 #include <time.h> // for time_t
 
 #include <memory>
@@ -31,7 +32,9 @@ public:
 			size(0),
 			atime(0),
 			mtime(0),
-			ctime(0)
+			ctime(0),
+			device(0),
+			inode(0)
 		{
 		}
 
@@ -43,6 +46,13 @@ public:
 		time_t mtime;
 		time_t ctime;
 
+		/**
+		Identity of the file: paths with the same device and inode refer
+		to the same file (hard links).
+		*/
+		uint64_t device;
+		uint64_t inode;
+
 	};
 
 	Directory(const char* path, bool followSymlinks);
@@ -53,6 +53,8 @@ Directory::Stat::Stat(const char* path, bool followSymlinks)
 	atime = s.st_atime;
 	mtime = s.st_mtime;
 	ctime = s.st_ctime;
+	device = s.st_dev;
+	inode = s.st_ino;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -234,6 +236,7 @@ Directory::~Directory()
 Directory& Directory::operator=(const Directory& that)
 {
 	data_ = that.data_;
+	return *this;
 }
 
 bool Directory::isValid() const
@@ -60,22 +60,15 @@ public:
 
 	bool operator==(const Data& that) const
 	{
-		bool thisIsValid = isValid();
-		bool thatIsValid = that.isValid();
-
-		if(!thisIsValid && !thatIsValid)
-		{
-			return true;
-		}
-
-		if(!thisIsValid || !thatIsValid)
-		{
-			return false;
-		}
-
 		return dirs_ == that.dirs_;
 	}
 
+	bool isValid() const
+	{
+		auto d = dir();
+		return d && d->isValid();
+	}
+
 private:
 	std::vector<Directory> dirs_;
 	bool followSymlinks_;
@@ -115,17 +108,6 @@ private:
 		dirs_.pop_back();
 	}
 
-	bool isValid() const
-	{
-		if(this == nullptr)
-		{
-			return false;
-		}
-
-		auto d = dir();
-		return d && d->isValid();
-	}
-
 };
 
 
@@ -161,6 +143,7 @@ DirectoryWalker::iterator::~iterator()
 DirectoryWalker::iterator& DirectoryWalker::iterator::operator=(const iterator& that)
 {
 	data_ = that.data_;
+	return *this;
 }
 
 
@@ -192,6 +175,15 @@ DirectoryWalker::iterator& DirectoryWalker::iterator::operator++()
 
 bool DirectoryWalker::iterator::operator==(const iterator& that) const
 {
+	// end iterator has no data at all
+	const bool thisIsValid = data_ && data_->isValid();
+	const bool thatIsValid = that.data_ && that.data_->isValid();
+
+	if(!thisIsValid || !thatIsValid)
+	{
+		return thisIsValid == thatIsValid;
+	}
+
 	return *data_ == *that.data_;
 }
 
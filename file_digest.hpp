@@ -0,0 +1,66 @@
+#ifndef FILE_DIGEST_HPP_INCLUDED
+#define FILE_DIGEST_HPP_INCLUDED
+
+
+#include <stddef.h> // for size_t
+#include <string.h>
+
+#include "SHA1.h"
+
+
+/**
+SHA-1 digest of file contents.
+*/
+class FileDigest
+{
+public:
+	FileDigest()
+	{
+		memset(data_, 0, sizeof(data_));
+	}
+
+	FileDigest(const FileDigest& that)
+	{
+		memcpy(data_, that.data_, sizeof(data_));
+	}
+
+	FileDigest& operator=(const FileDigest& that)
+	{
+		memcpy(data_, that.data_, sizeof(data_));
+		return *this;
+	}
+
+	UINT_8* data()
+	{
+		return data_;
+	}
+
+	const UINT_8* data() const
+	{
+		return data_;
+	}
+
+	size_t hash() const
+	{
+		size_t result;
+		memcpy(&result, data_, sizeof(result));
+		return result;
+	}
+
+	bool operator==(const FileDigest& that) const
+	{
+		return memcmp(data_, that.data_, sizeof(data_)) == 0;
+	}
+
+	bool operator!=(const FileDigest& that) const
+	{
+		return !(*this == that);
+	}
+
+private:
+	UINT_8 data_[20];
+
+};
+
+
+#endif
@@ -0,0 +1,303 @@
+#include "file_info.hpp"
+#include "fingerprint_cache.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+
+
+namespace
+{
+
+	// samples of smaller fingerprints have too few hashes for an estimate
+	const size_t MIN_SAMPLED_ENTRIES = 1024;
+
+}
+
+
+bool dataIsBinary(const void* data, size_t size)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	const size_t n = std::min(size, BINARY_CHECK_SIZE);
+
+	for(size_t i = 0; i != n; ++i)
+	{
+		if(!std::isprint(p[i]) && !std::isspace(p[i]))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+bool fileIsBinary(const char* fileName)
+{
+	std::ifstream stream(fileName, std::ios_base::in | std::ios_base::binary);
+	if(!stream.is_open())
+	{
+		throw std::runtime_error(std::string("failed to open file: '") + fileName + "'");
+	}
+
+	// read up to BINARY_CHECK_SIZE bytes
+	char buffer[BINARY_CHECK_SIZE];
+	stream.read(buffer, sizeof(buffer));
+
+	return dataIsBinary(buffer, stream.gcount());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+FileInfo::FileInfo(const std::string& name, size_t size):
+	name_(PathStore::add(name)),
+	size_(size),
+	binary_(false),
+	digest_(),
+	spanHash_(),
+	sample_(),
+	spanHashRefs_(0),
+	fingerprint_(nullptr),
+	indexed_(false),
+	origin_(nullptr)
+{
+}
+
+
+FileInfo::FileInfo(FileInfo&& that):
+	name_(that.name_),
+	size_(that.size_),
+	binary_(that.binary_),
+	digest_(std::move(that.digest_)),
+	spanHash_(std::move(that.spanHash_)),
+	sample_(std::move(that.sample_)),
+	spanHashRefs_(that.spanHashRefs_),
+	fingerprint_(that.fingerprint_),
+	indexed_(that.indexed_),
+	origin_(that.origin_)
+{
+	that.spanHashRefs_ = 0;
+}
+
+
+FileInfo& FileInfo::operator=(FileInfo&& that)
+{
+	name_ = that.name_;
+	size_ = that.size_;
+	binary_ = that.binary_;
+	digest_ = std::move(that.digest_);
+	spanHash_ = std::move(that.spanHash_);
+	sample_ = std::move(that.sample_);
+	spanHashRefs_ = that.spanHashRefs_;
+	that.spanHashRefs_ = 0;
+	fingerprint_ = that.fingerprint_;
+	indexed_ = that.indexed_;
+	origin_ = that.origin_;
+
+	return *this;
+}
+
+
+void FileInfo::acquireSpanHash(const SpanHash::Options& options)
+{
+	if(origin_)
+	{
+		origin_->acquireSpanHash(options);
+		return;
+	}
+
+	if(indexed_)
+	{
+		// fingerprint is always available
+		return;
+	}
+
+	if(spanHashRefs_ == -1)
+	{
+		// counter overflow, don't increment it further
+		return;
+	}
+
+	spanHashRefs_ += 1;
+
+	if(spanHashRefs_ == 1)
+	{
+		{
+			TRACE_SCOPE("fingerprint");
+			Stats::Timer timer(Stats::SpanHashTime);
+
+			if(fingerprint_)
+			{
+				spanHash_ = fingerprint_->spanHash();
+			}
+			else
+			{
+				spanHash_.init(name().c_str(), binary_, options);
+			}
+		}
+
+		if(!fingerprint_)
+		{
+			Stats::add(Stats::SpanHashBytes, size_);
+			Stats::add(Stats::BytesRead, size_);
+		}
+
+		Stats::add(Stats::SpanHashBuilds);
+		Stats::adjust(Stats::FingerprintMemory, spanHash_.memoryUsage());
+	}
+}
+
+
+void FileInfo::releaseSpanHash()
+{
+	if(origin_)
+	{
+		origin_->releaseSpanHash();
+		return;
+	}
+
+	if(indexed_)
+	{
+		return;
+	}
+
+	if(spanHashRefs_ == -1)
+	{
+		// counter overflow, don't ever release
+		return;
+	}
+
+	if(spanHashRefs_ > 0)
+	{
+		spanHashRefs_ -= 1;
+	}
+
+	if(spanHashRefs_ == 0)
+	{
+		Stats::adjust(Stats::FingerprintMemory, -static_cast<int64_t>(spanHash_.memoryUsage() + sample_.memoryUsage()));
+		spanHash_.clear();
+		sample_ = SpanHash();
+	}
+}
+
+
+void FileInfo::buildSample()
+{
+	if(origin_)
+	{
+		origin_->buildSample();
+		return;
+	}
+
+	if(sample_.isValid() || !spanHash_.isValid() || spanHash_.entryCount() < MIN_SAMPLED_ENTRIES)
+	{
+		return;
+	}
+
+	sample_ = spanHash_.sample();
+	Stats::adjust(Stats::FingerprintMemory, sample_.memoryUsage());
+}
+
+
+bool FileInfo::read()
+{
+	origin_ = nullptr;
+
+	if(indexed_)
+	{
+		return true;
+	}
+
+	TRACE_SCOPE("read");
+
+	const std::string name = this->name();
+
+	// check if file is binary
+	binary_ = fileIsBinary(name.c_str());
+
+	// calculate file digest
+	CSHA1 sha1;
+	{
+		Stats::Timer timer(Stats::Sha1Time);
+		if(!sha1.HashFile(name.c_str()))
+		{
+			std::cerr << "ERROR: failed to read file: '" << name << "'" << std::endl;
+			return false;
+		}
+		sha1.Final();
+	}
+
+	Stats::add(Stats::FilesRead);
+	Stats::add(Stats::BytesRead, size_);
+	Stats::add(Stats::Sha1Bytes, size_);
+
+	sha1.GetHash(digest_.data());
+
+	return true;
+}
+
+
+bool FileInfo::read(FingerprintCache& cache)
+{
+	origin_ = nullptr;
+
+	if(indexed_)
+	{
+		return true;
+	}
+
+	TRACE_SCOPE("read");
+	Stats::Timer timer(Stats::Sha1Time);
+
+	fingerprint_ = cache.update(name());
+	if(!fingerprint_)
+	{
+		return false;
+	}
+
+	Stats::add(Stats::FilesRead);
+
+	read(*fingerprint_);
+
+	return true;
+}
+
+
+void FileInfo::read(const Fingerprint& fingerprint)
+{
+	fingerprint_ = &fingerprint;
+	binary_ = fingerprint.isBinary();
+	digest_ = fingerprint.digest();
+	origin_ = nullptr;
+}
+
+
+void FileInfo::assign(bool binary, const FileDigest& digest, SpanHash&& spanHash)
+{
+	binary_ = binary;
+	digest_ = digest;
+	spanHash_ = std::move(spanHash);
+	fingerprint_ = nullptr;
+	indexed_ = true;
+	origin_ = nullptr;
+}
+
+
+void FileInfo::share(FileInfo& origin)
+{
+	if(spanHashRefs_ != 0 && !indexed_)
+	{
+		// own fingerprint is not used anymore
+		Stats::adjust(Stats::FingerprintMemory, -static_cast<int64_t>(spanHash_.memoryUsage() + sample_.memoryUsage()));
+		spanHash_.clear();
+		sample_ = SpanHash();
+		spanHashRefs_ = 0;
+	}
+
+	binary_ = origin.binary_;
+	digest_ = origin.digest_;
+	origin_ = origin.origin_ ? origin.origin_ : &origin;
+}
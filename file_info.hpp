@@ -0,0 +1,176 @@
+#ifndef FILE_INFO_HPP_INCLUDED
+#define FILE_INFO_HPP_INCLUDED
+
+
+#include <stddef.h> // for size_t
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+#include "file_digest.hpp"
+#include "path_store.hpp"
+#include "spanhash.hpp"
+
+
+class FingerprintCache;
+class Fingerprint;
+
+
+/**
+Number of leading bytes that determine whether data is binary.
+*/
+const size_t BINARY_CHECK_SIZE = 1024;
+
+/**
+Check if data looks binary (based on its first BINARY_CHECK_SIZE bytes).
+*/
+bool dataIsBinary(const void* data, size_t size);
+
+/**
+Check if file contents look binary (based on its first BINARY_CHECK_SIZE
+bytes). Throws std::runtime_error if file can't be opened.
+*/
+bool fileIsBinary(const char* fileName);
+
+
+/**
+File taking part in comparison: its name, size, digest and fingerprint.
+*/
+class FileInfo
+{
+public:
+	FileInfo(const std::string& name, size_t size);
+	FileInfo(FileInfo&& that);
+
+	FileInfo& operator=(FileInfo&& that);
+
+	/**
+	Path is kept in PathStore and rebuilt on each call.
+	*/
+	std::string name() const
+	{
+		return PathStore::path(name_);
+	}
+
+	/**
+	Files have equal ids if and only if their names are equal.
+	*/
+	PathStore::Id nameId() const
+	{
+		return name_;
+	}
+
+	size_t size() const
+	{
+		return size_;
+	}
+
+	bool isBinary() const
+	{
+		return binary_;
+	}
+
+	const FileDigest& digest() const
+	{
+		return digest_;
+	}
+
+	const SpanHash& spanHash() const
+	{
+		return origin_ ? origin_->spanHash_ : spanHash_;
+	}
+
+	/**
+	Fingerprint is built on the first acquisition and freed when the last
+	reference is released. It is built with the given settings unless it
+	comes from a cached or indexed fingerprint.
+	*/
+	void acquireSpanHash(const SpanHash::Options& options);
+	void releaseSpanHash();
+
+	/**
+	Sampled copy of the fingerprint for approximate comparison, see
+	SpanHash::sample(). Built by buildSample() while the fingerprint is
+	acquired and freed together with it. Not built for fingerprints with
+	too few entries to be estimated from a sample.
+	*/
+	const SpanHash& sample() const
+	{
+		return origin_ ? origin_->sample_ : sample_;
+	}
+
+	void buildSample();
+
+	/**
+	Detect binary flag and calculate digest.
+	*/
+	bool read();
+
+	/**
+	Same as read() but take binary flag and digest from the cache, only new
+	file data is read. Fingerprint is built from the cached state as well.
+	*/
+	bool read(FingerprintCache& cache);
+
+	/**
+	Take binary flag, digest and fingerprint from already ingested data
+	instead of reading the file. `fingerprint` must outlive this object.
+	*/
+	void read(const Fingerprint& fingerprint);
+
+	/**
+	Take binary flag, digest and fingerprint stored in an index file. The
+	file itself is never read after that, `spanHash` is supposed to refer to
+	the index memory and is never released.
+	*/
+	void assign(bool binary, const FileDigest& digest, SpanHash&& spanHash);
+
+	bool isIndexed() const
+	{
+		return indexed_;
+	}
+
+	/**
+	Take binary flag and digest of another path of the same file (the same
+	path listed twice or a hard link) that is already read. Its fingerprint
+	is shared too: acquisition and release are forwarded to `origin`, which
+	must stay in place until the next read().
+	*/
+	void share(FileInfo& origin);
+
+private:
+	PathStore::Id name_;
+	size_t size_;
+	bool binary_;
+	FileDigest digest_;
+	SpanHash spanHash_;
+	SpanHash sample_;
+	size_t spanHashRefs_;
+	const Fingerprint* fingerprint_;
+	bool indexed_;
+	FileInfo* origin_; // file whose digest and fingerprint are shared
+
+};
+
+
+typedef std::vector<FileInfo> FileList;
+
+
+struct DigestIndexPred
+{
+	bool operator()(const FileInfo* lhs, const FileInfo* rhs) const
+	{
+		return lhs->digest() == rhs->digest();
+	}
+
+	size_t operator()(const FileInfo* v) const
+	{
+		return v->digest().hash();
+	}
+};
+
+typedef std::unordered_multiset<FileInfo*, DigestIndexPred, DigestIndexPred> DigestIndex;
+
+
+#endif
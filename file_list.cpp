@@ -0,0 +1,96 @@
+#include "file_list.hpp"
+#include "directory_walker.hpp"
+
+#include <iostream>
+#include <fstream>
+
+#include <string.h>
+
+
+namespace
+{
+
+	bool xgetline(std::istream& stream, std::string& out)
+	{
+		bool nonEmpty = false;
+		for(int c = stream.get(); c != EOF; c = stream.get())
+		{
+			if(c == '\r' || c == '\n')
+			{
+				break;
+			}
+
+			out.push_back(c);
+			nonEmpty = true;
+		}
+
+		return nonEmpty;
+	}
+
+}
+
+
+void addPath(FileList& list, const char* path, bool followSymlinks)
+{
+	//std::cerr << "adding " << path << std::endl;
+	const Directory::Stat stat(path, followSymlinks);
+	switch(stat.fileType)
+	{
+	case Directory::Stat::Directory:
+		for(auto f: DirectoryWalker(path, followSymlinks))
+		{
+			if(f.second.fileType == Directory::Stat::Regular)
+			{
+				//std::cerr << "found " << f.first << std::endl;
+				list.emplace_back(f.first, f.second.size);
+			}
+		}
+		break;
+
+	case Directory::Stat::Regular:
+		//std::cerr << "file " << path << std::endl;
+		list.emplace_back(path, stat.size);
+		break;
+
+	}
+}
+
+
+void addListFile(FileList& list, const char* path, bool followSymlinks, std::vector<std::string>* roots)
+{
+	const char* colon = strchr(path, ':');
+	const char* p = colon ? colon + 1 : path;
+
+	std::ifstream ifs(p, std::ios_base::in | std::ios_base::binary);
+	if(!ifs.good())
+	{
+		std::cerr << "ERROR: failed to open file: '" << p << "'" << std::endl;
+		return;
+	}
+
+	std::string f;
+	do
+	{
+		if(colon)
+		{
+			f.assign(path, colon);
+		}
+		else
+		{
+			f.clear();
+		}
+
+		if(!xgetline(ifs, f))
+		{
+			continue;
+		}
+
+		addPath(list, f.c_str(), followSymlinks);
+
+		if(roots)
+		{
+			roots->push_back(f);
+		}
+	}
+	while(ifs.good());
+}
@@ -0,0 +1,25 @@
+#ifndef FILE_LIST_HPP_INCLUDED
+#define FILE_LIST_HPP_INCLUDED
+
+
+#include <string>
+#include <vector>
+
+#include "file_info.hpp"
+
+
+/**
+Add regular file or all regular files inside directory (recursively) to the
+list.
+*/
+void addPath(FileList& list, const char* path, bool followSymlinks);
+
+/**
+Add paths listed in the given file (one path per line). `path` has format
+`[<prefix>:]<path>`, optional prefix is prepended to each listed path.
+If `roots` is given then listed paths are appended to it.
+*/
+void addListFile(FileList& list, const char* path, bool followSymlinks, std::vector<std::string>* roots = nullptr);
+
+
+#endif
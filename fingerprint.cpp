@@ -0,0 +1,190 @@
+#include "fingerprint.hpp"
+#include "file_info.hpp"
+#include "serialize.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+
+namespace
+{
+
+	const size_t READ_CHUNK = 64 * 1024;
+
+}
+
+
+Fingerprint::Fingerprint(const SpanHash::Options& options):
+	offset_(0),
+	binaryKnown_(false),
+	head_(),
+	sha1_(),
+	options_(options),
+	builder_(false, options)
+{
+	reset();
+}
+
+
+bool Fingerprint::isBinary() const
+{
+	if(binaryKnown_)
+	{
+		return builder_.isBinary();
+	}
+	else
+	{
+		return dataIsBinary(head_.data(), head_.size());
+	}
+}
+
+
+void Fingerprint::reset()
+{
+	offset_ = 0;
+	binaryKnown_ = false;
+	head_.clear();
+	builder_ = SpanHash::Builder(false, options_);
+
+	CSHA1 sha1;
+	sha1.GetState(sha1_);
+}
+
+
+void Fingerprint::update(const void* data, size_t size)
+{
+	const UINT_8* p = static_cast<const UINT_8*>(data);
+
+	CSHA1 sha1;
+	sha1.SetState(sha1_);
+	for(size_t done = 0; done != size; )
+	{
+		const size_t n = std::min<size_t>(size - done, READ_CHUNK);
+		sha1.Update(p + done, static_cast<UINT_32>(n));
+		done += n;
+	}
+	sha1.GetState(sha1_);
+
+	offset_ += size;
+
+	if(binaryKnown_)
+	{
+		builder_.update(data, size);
+		return;
+	}
+
+	// span hash depends on binary flag, so keep data until the flag is known
+	head_.append(reinterpret_cast<const char*>(data), size);
+	if(head_.size() >= BINARY_CHECK_SIZE)
+	{
+		builder_ = SpanHash::Builder(dataIsBinary(head_.data(), head_.size()), options_);
+		builder_.update(head_.data(), head_.size());
+		binaryKnown_ = true;
+
+		std::string empty;
+		head_.swap(empty);
+	}
+}
+
+
+bool Fingerprint::ingest(const char* fileName)
+{
+	TRACE_SCOPE("ingest");
+
+	std::ifstream stream(fileName, std::ios_base::in | std::ios_base::binary);
+	if(!stream.is_open())
+	{
+		std::cerr << "ERROR: failed to open file: '" << fileName << "'" << std::endl;
+		return false;
+	}
+
+	if(!stream.seekg(offset_))
+	{
+		std::cerr << "ERROR: failed to seek file: '" << fileName << "'" << std::endl;
+		return false;
+	}
+
+	std::vector<char> buffer(READ_CHUNK);
+	while(stream)
+	{
+		stream.read(buffer.data(), buffer.size());
+		update(buffer.data(), stream.gcount());
+
+		Stats::add(Stats::BytesRead, stream.gcount());
+		Stats::add(Stats::Sha1Bytes, stream.gcount());
+		Stats::add(Stats::SpanHashBytes, stream.gcount());
+	}
+
+	return stream.eof();
+}
+
+
+FileDigest Fingerprint::digest() const
+{
+	CSHA1 sha1;
+	sha1.SetState(sha1_);
+	sha1.Final();
+
+	FileDigest result;
+	sha1.GetHash(result.data());
+	return result;
+}
+
+
+SpanHash Fingerprint::spanHash() const
+{
+	if(binaryKnown_)
+	{
+		SpanHash::Builder builder(builder_);
+		return builder.finish();
+	}
+	else
+	{
+		SpanHash::Builder builder(isBinary(), options_);
+		builder.update(head_.data(), head_.size());
+		return builder.finish();
+	}
+}
+
+
+void Fingerprint::save(std::ostream& out) const
+{
+	Serialize::write<uint64_t>(out, offset_);
+	Serialize::write<uint8_t>(out, binaryKnown_);
+	Serialize::writeString(out, head_);
+	Serialize::write(out, sha1_);
+	builder_.save(out);
+}
+
+
+bool Fingerprint::load(std::istream& in)
+{
+	uint64_t offset = 0;
+	uint8_t binaryKnown = 0;
+
+	if(
+		!Serialize::read(in, offset) ||
+		!Serialize::read(in, binaryKnown) ||
+		!Serialize::readString(in, head_) ||
+		!Serialize::read(in, sha1_) ||
+		!builder_.load(in))
+	{
+		reset();
+		return false;
+	}
+
+	offset_ = offset;
+	binaryKnown_ = (binaryKnown != 0);
+
+	if(binaryKnown_ && builder_.isChunked() != (builder_.isBinary() && options_.binaryChunking))
+	{
+		// spans were cut the other way, data has to be ingested again
+		reset();
+	}
+
+	return true;
+}
@@ -0,0 +1,69 @@
+#ifndef FINGERPRINT_HPP_INCLUDED
+#define FINGERPRINT_HPP_INCLUDED
+
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+
+#include <string>
+#include <iosfwd>
+
+#include "SHA1.h"
+#include "file_digest.hpp"
+#include "spanhash.hpp"
+
+
+/**
+Resumable ingestion state of file contents: binary flag, SHA-1 context and
+span hash builder state.
+
+The state can be saved and later restored to continue ingestion from the
+previous end offset, so for files that only grow just the new bytes are
+hashed.
+*/
+class Fingerprint
+{
+public:
+	explicit Fingerprint(const SpanHash::Options& options);
+
+	/**
+	Number of bytes ingested so far.
+	*/
+	uint64_t offset() const
+	{
+		return offset_;
+	}
+
+	bool isBinary() const;
+
+	void reset();
+
+	void update(const void* data, size_t size);
+
+	/**
+	Read the given file starting from offset() up to its end.
+	*/
+	bool ingest(const char* fileName);
+
+	/**
+	Digest and fingerprint of data ingested so far. Ingestion may continue
+	after these calls.
+	*/
+	FileDigest digest() const;
+	SpanHash spanHash() const;
+
+	void save(std::ostream& out) const;
+	bool load(std::istream& in);
+
+private:
+	uint64_t offset_;
+	bool binaryKnown_;
+	std::string head_; // data seen before the binary flag is known
+	SHA1_STATE sha1_;
+	SpanHash::Options options_;
+	SpanHash::Builder builder_;
+
+};
+
+
+#endif
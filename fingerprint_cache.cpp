@@ -0,0 +1,168 @@
+#include "fingerprint_cache.hpp"
+#include "directory.hpp"
+#include "serialize.hpp"
+
+#include <fstream>
+#include <iostream>
+
+#include <string.h>
+
+
+namespace
+{
+
+	const char MAGIC[8] = { 'S', 'I', 'M', 'F', 'P', 'C', '0', '3' };
+
+	// leading part of MAGIC that stays the same in all versions
+	const size_t MAGIC_PREFIX_SIZE = 6;
+
+}
+
+
+FingerprintCache::FingerprintCache(const SpanHash::Options& options):
+	options_(options),
+	appendOnly_(false),
+	entries_()
+{
+}
+
+
+void FingerprintCache::setAppendOnly(bool v)
+{
+	appendOnly_ = v;
+}
+
+
+bool FingerprintCache::load(const std::string& fileName)
+{
+	entries_.clear();
+
+	std::ifstream in(fileName, std::ios_base::in | std::ios_base::binary);
+	if(!in.is_open())
+	{
+		return true;
+	}
+
+	char magic[sizeof(MAGIC)];
+	const bool known = Serialize::read(in, magic) && memcmp(magic, MAGIC, MAGIC_PREFIX_SIZE) == 0;
+	if(known && memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+	{
+		// cache of another version is rebuilt from scratch
+		return true;
+	}
+
+	uint64_t count = 0;
+	if(!known || !Serialize::read(in, count))
+	{
+		std::cerr << "ERROR: invalid fingerprint cache: '" << fileName << "'" << std::endl;
+		return false;
+	}
+
+	for(uint64_t i = 0; i != count; ++i)
+	{
+		std::string name;
+		Entry entry(options_);
+		if(
+			!Serialize::readString(in, name) ||
+			!Serialize::read(in, entry.size) ||
+			!Serialize::read(in, entry.mtime) ||
+			!entry.fingerprint.load(in))
+		{
+			std::cerr << "ERROR: truncated fingerprint cache: '" << fileName << "'" << std::endl;
+			entries_.clear();
+			return false;
+		}
+
+		entries_.emplace(name, std::move(entry));
+	}
+
+	return true;
+}
+
+
+bool FingerprintCache::save(const std::string& fileName) const
+{
+	std::ofstream out(fileName, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+	if(!out.is_open())
+	{
+		std::cerr << "ERROR: failed to open file: '" << fileName << "'" << std::endl;
+		return false;
+	}
+
+	uint64_t count = 0;
+	for(const auto& entry: entries_)
+	{
+		if(entry.second.used)
+		{
+			count += 1;
+		}
+	}
+
+	Serialize::write(out, MAGIC);
+	Serialize::write(out, count);
+
+	for(const auto& entry: entries_)
+	{
+		// drop files that are not seen anymore
+		if(!entry.second.used)
+		{
+			continue;
+		}
+
+		Serialize::writeString(out, entry.first);
+		Serialize::write(out, entry.second.size);
+		Serialize::write(out, entry.second.mtime);
+		entry.second.fingerprint.save(out);
+	}
+
+	return out.good();
+}
+
+
+const Fingerprint* FingerprintCache::update(const std::string& fileName)
+{
+	const Directory::Stat stat(fileName.c_str(), true);
+	if(stat.fileType != Directory::Stat::Regular)
+	{
+		std::cerr << "ERROR: failed to read file: '" << fileName << "'" << std::endl;
+		entries_.erase(fileName);
+		return nullptr;
+	}
+
+	Entry& entry = entries_.emplace(fileName, Entry(options_)).first->second;
+	entry.used = true;
+
+	if(entry.fingerprint.offset() == stat.size && entry.size == stat.size && entry.mtime == stat.mtime)
+	{
+		// up to date
+		return &entry.fingerprint;
+	}
+
+	const bool grown =
+		entry.fingerprint.offset() == entry.size &&
+		entry.size < stat.size &&
+		entry.mtime <= stat.mtime;
+
+	if(!appendOnly_ || !grown)
+	{
+		entry.fingerprint.reset();
+	}
+
+	if(!entry.fingerprint.ingest(fileName.c_str()))
+	{
+		std::cerr << "ERROR: failed to read file: '" << fileName << "'" << std::endl;
+		entries_.erase(fileName);
+		return nullptr;
+	}
+
+	entry.size = entry.fingerprint.offset();
+	entry.mtime = stat.mtime;
+
+	return &entry.fingerprint;
+}
+
+
+void FingerprintCache::remove(const std::string& fileName)
+{
+	entries_.erase(fileName);
+}
@@ -0,0 +1,85 @@
+#ifndef FINGERPRINT_CACHE_HPP_INCLUDED
+#define FINGERPRINT_CACHE_HPP_INCLUDED
+
+
+#include <time.h> // for time_t
+
+#include <string>
+#include <unordered_map>
+
+#include "fingerprint.hpp"
+
+
+/**
+Persistent fingerprint states of files keyed by file name.
+
+Fingerprints are built with the settings given to the constructor, cached
+states built with other ones are ingested again.
+
+File is re-read only when its size or modification time changed. In
+append-only mode a file that grew is assumed to keep its previous contents
+and only the appended bytes are ingested.
+*/
+class FingerprintCache
+{
+public:
+	explicit FingerprintCache(const SpanHash::Options& options);
+
+	bool isAppendOnly() const
+	{
+		return appendOnly_;
+	}
+
+	void setAppendOnly(bool v);
+
+	/**
+	Missing cache file is not an error, the cache is just empty.
+	*/
+	bool load(const std::string& fileName);
+
+	/**
+	Save fingerprints of files updated since load().
+	*/
+	bool save(const std::string& fileName) const;
+
+	/**
+	Bring fingerprint of the given file up to date. Returns nullptr on read
+	error. Returned pointer stays valid until the next update() of the same
+	file or destruction of the cache.
+	Not thread safe.
+	*/
+	const Fingerprint* update(const std::string& fileName);
+
+	/**
+	Forget the fingerprint of a file that doesn't exist anymore. Pointer
+	returned by update() for it becomes invalid.
+	*/
+	void remove(const std::string& fileName);
+
+private:
+	struct Entry
+	{
+		explicit Entry(const SpanHash::Options& options):
+			size(0),
+			mtime(0),
+			used(false),
+			fingerprint(options)
+		{
+		}
+
+		uint64_t size;
+		int64_t mtime;
+		bool used;
+		Fingerprint fingerprint;
+	};
+
+	typedef std::unordered_map<std::string, Entry> Entries;
+
+	SpanHash::Options options_;
+	bool appendOnly_;
+	Entries entries_;
+
+};
+
+
+#endif
@@ -8,6 +8,22 @@ Hasher::Hasher():
 }
 
 
+Hasher::State Hasher::state() const
+{
+	State result;
+	result.accum1 = accum1_;
+	result.accum2 = accum2_;
+	return result;
+}
+
+
+void Hasher::setState(const State& v)
+{
+	accum1_ = v.accum1;
+	accum2_ = v.accum2;
+}
+
+
 void Hasher::start()
 {
 	accum1_ = 0;
@@ -26,8 +42,7 @@ void Hasher::push(unsigned char c)
 
 Hasher::Hash Hasher::stop()
 {
-	const Hash HASHBASE = 107927;
-	Hash r = (accum1_ + accum2_ * 0x61) % HASHBASE;
+	Hash r = (accum1_ + accum2_ * 0x61) % HASH_COUNT;
 	start();
 	return r;
 }
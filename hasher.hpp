@@ -6,9 +6,26 @@ class Hasher
 {
 public:
 	typedef unsigned Hash;
+
+	/**
+	Number of distinct hash values, stop() returns values below it.
+	*/
+	static const Hash HASH_COUNT = 107927;
 	
+	/**
+	Intermediate state, allows to suspend hashing and resume it later.
+	*/
+	struct State
+	{
+		unsigned accum1;
+		unsigned accum2;
+	};
+
 	Hasher();
 	
+	State state() const;
+	void setState(const State& v);
+
 	void start();
 	void push(unsigned char c);
 	Hash stop();
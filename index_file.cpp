@@ -0,0 +1,344 @@
+#include "index_file.hpp"
+#include "fingerprint_cache.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+
+namespace
+{
+
+	const char MAGIC[8] = {'S', 'I', 'M', 'I', 'D', 'X', '0', '1'};
+	const uint32_t VERSION = 1;
+	const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t byteOrder;
+		uint64_t fileCount;
+		uint64_t recordsOffset;
+		uint64_t namesOffset;
+		uint64_t namesSize;
+	};
+
+	/**
+	Fingerprint of a file is stored at `entriesOffset` as `entryCount` hashes
+	followed by `entryCount` counts aligned to 8 bytes.
+	*/
+	struct Record
+	{
+		uint64_t nameOffset;
+		uint64_t nameLength;
+		uint64_t size;
+		uint64_t spanSize;
+		uint64_t entriesOffset;
+		uint64_t entryCount;
+		uint8_t digest[20];
+		uint8_t binary;
+		uint8_t valid;
+		uint8_t chunked; // binary file is split into content-defined chunks
+		uint8_t sampleRate; // 0 in older files means no sampling
+	};
+
+	static_assert(sizeof(Hasher::Hash) == sizeof(uint32_t), "index stores span hashes as 32 bit values");
+	static_assert(sizeof(Header) % 8 == 0 && sizeof(Record) % 8 == 0, "index structures must keep 8 byte alignment");
+
+	uint64_t align8(uint64_t v)
+	{
+		return (v + 7) & ~static_cast<uint64_t>(7);
+	}
+
+	uint64_t countsOffset(const Record& record)
+	{
+		return align8(record.entriesOffset + record.entryCount * sizeof(Hasher::Hash));
+	}
+
+	void pad(std::ostream& out)
+	{
+		static const char zeros[8] = {};
+		const uint64_t pos = out.tellp();
+		out.write(zeros, align8(pos) - pos);
+	}
+
+}
+
+
+IndexFile::IndexFile():
+	fd_(-1),
+	data_(nullptr),
+	size_(0)
+{
+}
+
+
+IndexFile::~IndexFile()
+{
+	close();
+}
+
+
+bool IndexFile::isIndexFile(const char* path)
+{
+	std::ifstream stream(path, std::ios_base::in | std::ios_base::binary);
+
+	char magic[sizeof(MAGIC)];
+	if(!stream.read(magic, sizeof(magic)))
+	{
+		return false;
+	}
+
+	return memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+
+bool IndexFile::write(const std::string& path, FileList& files, FingerprintCache* cache, const SpanHash::Options& options, const Matcher::ProgressCallback& progress)
+{
+	std::ofstream out(path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+	if(!out.is_open())
+	{
+		std::cerr << "ERROR: failed to open file: '" << path << "'" << std::endl;
+		return false;
+	}
+
+	Header header;
+	memset(&header, 0, sizeof(header));
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	std::vector<Record> records;
+	records.reserve(files.size());
+	std::string names;
+	std::vector<Hasher::Hash> hashes;
+	std::vector<SpanHash::Count> counts;
+
+	// fingerprints go first, so each one is written as soon as it is built
+	for(size_t i = 0; i != files.size(); ++i)
+	{
+		auto& fi = files[i];
+
+		if(cache ? fi.read(*cache) : fi.read())
+		{
+			fi.acquireSpanHash(options);
+			const SpanHash& spanHash = fi.spanHash();
+
+			Record record;
+			memset(&record, 0, sizeof(record));
+			const std::string name = fi.name();
+			record.nameOffset = names.size();
+			record.nameLength = name.size();
+			record.size = fi.size();
+			record.spanSize = spanHash.size();
+			record.entriesOffset = out.tellp();
+			record.entryCount = spanHash.entryCount();
+			memcpy(record.digest, fi.digest().data(), sizeof(record.digest));
+			record.binary = fi.isBinary();
+			record.valid = spanHash.isValid();
+			record.chunked = fi.isBinary() && options.binaryChunking;
+			record.sampleRate = spanHash.sampleRate();
+
+			// index always keeps sorted entries
+			spanHash.entries(hashes, counts);
+			out.write(reinterpret_cast<const char*>(hashes.data()), record.entryCount * sizeof(Hasher::Hash));
+			pad(out);
+			out.write(reinterpret_cast<const char*>(counts.data()), record.entryCount * sizeof(SpanHash::Count));
+
+			fi.releaseSpanHash();
+
+			records.push_back(record);
+			names += name;
+		}
+
+		if(progress)
+		{
+			progress(i + 1, files.size());
+		}
+	}
+
+	pad(out);
+	header.recordsOffset = out.tellp();
+	out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Record));
+
+	header.namesOffset = out.tellp();
+	header.namesSize = names.size();
+	out.write(names.data(), names.size());
+
+	// header is written last, so incomplete file is never taken for index
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.byteOrder = BYTE_ORDER_MARK;
+	header.fileCount = records.size();
+
+	out.seekp(0);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	if(!out.flush())
+	{
+		std::cerr << "ERROR: failed to write file: '" << path << "'" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+
+bool IndexFile::open(const std::string& path, const SpanHash::Options& options)
+{
+	close();
+
+	fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd_ < 0)
+	{
+		std::cerr << "ERROR: failed to open file: '" << path << "'" << std::endl;
+		return false;
+	}
+
+	struct stat st;
+	if(fstat(fd_, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header))
+	{
+		std::cerr << "ERROR: invalid index file: '" << path << "'" << std::endl;
+		close();
+		return false;
+	}
+
+	void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd_, 0);
+	if(data == MAP_FAILED)
+	{
+		std::cerr << "ERROR: failed to map file: '" << path << "'" << std::endl;
+		close();
+		return false;
+	}
+
+	data_ = static_cast<const char*>(data);
+	size_ = st.st_size;
+
+	const Header& header = *reinterpret_cast<const Header*>(data_);
+	if(memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION)
+	{
+		std::cerr << "ERROR: unsupported index file: '" << path << "'" << std::endl;
+		close();
+		return false;
+	}
+
+	if(header.byteOrder != BYTE_ORDER_MARK)
+	{
+		std::cerr << "ERROR: index file has foreign byte order: '" << path << "'" << std::endl;
+		close();
+		return false;
+	}
+
+	// check bounds once, so they needn't be checked on access
+	bool ok =
+		header.recordsOffset % 8 == 0 &&
+		header.recordsOffset <= size_ &&
+		header.fileCount <= (size_ - header.recordsOffset) / sizeof(Record) &&
+		header.namesOffset <= size_ &&
+		header.namesSize <= size_ - header.namesOffset;
+
+	const Record* records = reinterpret_cast<const Record*>(data_ + header.recordsOffset);
+	for(uint64_t i = 0; ok && i != header.fileCount; ++i)
+	{
+		const Record& record = records[i];
+		ok =
+			record.nameOffset <= header.namesSize &&
+			record.nameLength <= header.namesSize - record.nameOffset &&
+			record.entriesOffset % 8 == 0 &&
+			record.entriesOffset <= size_ &&
+			record.entryCount <= (size_ - record.entriesOffset) / (sizeof(Hasher::Hash) + sizeof(SpanHash::Count)) &&
+			countsOffset(record) + record.entryCount * sizeof(SpanHash::Count) <= size_;
+	}
+
+	if(!ok)
+	{
+		std::cerr << "ERROR: index file is corrupted: '" << path << "'" << std::endl;
+		close();
+		return false;
+	}
+
+	// fingerprints of binary files built with other spans can't be compared
+	for(uint64_t i = 0; i != header.fileCount; ++i)
+	{
+		const Record& record = records[i];
+		if(record.binary && (record.chunked != 0) != options.binaryChunking)
+		{
+			std::cerr << "ERROR: index file was built with different --binary-chunks setting: '" << path << "'" << std::endl;
+			close();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+size_t IndexFile::fileCount() const
+{
+	if(!data_)
+	{
+		return 0;
+	}
+
+	return reinterpret_cast<const Header*>(data_)->fileCount;
+}
+
+
+void IndexFile::addFiles(FileList& list) const
+{
+	if(!data_)
+	{
+		return;
+	}
+
+	const Header& header = *reinterpret_cast<const Header*>(data_);
+	const Record* records = reinterpret_cast<const Record*>(data_ + header.recordsOffset);
+	const char* names = data_ + header.namesOffset;
+
+	list.reserve(list.size() + header.fileCount);
+
+	for(uint64_t i = 0; i != header.fileCount; ++i)
+	{
+		const Record& record = records[i];
+
+		FileDigest digest;
+		memcpy(digest.data(), record.digest, sizeof(record.digest));
+
+		SpanHash spanHash;
+		if(record.valid)
+		{
+			spanHash = SpanHash(
+				record.spanSize,
+				reinterpret_cast<const Hasher::Hash*>(data_ + record.entriesOffset),
+				reinterpret_cast<const SpanHash::Count*>(data_ + countsOffset(record)),
+				record.entryCount,
+				std::max<unsigned>(record.sampleRate, 1));
+		}
+
+		list.emplace_back(std::string(names + record.nameOffset, record.nameLength), record.size);
+		list.back().assign(record.binary != 0, digest, std::move(spanHash));
+	}
+}
+
+
+void IndexFile::close()
+{
+	if(data_)
+	{
+		munmap(const_cast<char*>(data_), size_);
+		data_ = nullptr;
+		size_ = 0;
+	}
+
+	if(fd_ >= 0)
+	{
+		::close(fd_);
+		fd_ = -1;
+	}
+}
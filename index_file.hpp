@@ -0,0 +1,67 @@
+#ifndef INDEX_FILE_HPP_INCLUDED
+#define INDEX_FILE_HPP_INCLUDED
+
+
+#include <stddef.h> // for size_t
+
+#include <string>
+
+#include "file_info.hpp"
+#include "matcher.hpp"
+
+
+/**
+Persistent index of files: names, sizes, digests, binary flags and sorted
+span fingerprints.
+
+The file is memory-mapped when opened and fingerprints are used directly
+from the mapping, so nothing is read until comparison touches it. Data is
+stored in native byte order, the file is rejected on a machine with a
+different one.
+*/
+class IndexFile
+{
+public:
+	IndexFile();
+	~IndexFile();
+
+	IndexFile(const IndexFile&) = delete;
+	IndexFile& operator=(const IndexFile&) = delete;
+
+	/**
+	Check if the given path refers to an index file (by its signature).
+	*/
+	static bool isIndexFile(const char* path);
+
+	/**
+	Read all files of the list and write their index to `path`. Files that
+	can't be read are skipped. Fingerprints are built one at a time with
+	the given settings.
+	*/
+	static bool write(const std::string& path, FileList& files, FingerprintCache* cache, const SpanHash::Options& options, const Matcher::ProgressCallback& progress);
+
+	/**
+	Fingerprints of the index must have been built with the given settings,
+	otherwise they can't be compared and the index is rejected.
+	*/
+	bool open(const std::string& path, const SpanHash::Options& options);
+
+	size_t fileCount() const;
+
+	/**
+	Append indexed files to the list. The files are already read and their
+	fingerprints refer to the mapped index, so it must outlive the list.
+	*/
+	void addFiles(FileList& list) const;
+
+private:
+	int fd_;
+	const char* data_;
+	size_t size_;
+
+	void close();
+
+};
+
+
+#endif
@@ -2,21 +2,16 @@
 #include <sstream>
 #include <fstream>
 #include <string>
-#include <stdexcept>
+#include <memory>
 #include <vector>
-#include <unordered_set>
-#include <algorithm>
-#include <thread>
 
 #include <getopt.h>
-#include <assert.h>
 #include <string.h>
 
-#include "spanhash.hpp"
-#include "directory_walker.hpp"
-#include "SHA1.h"
+#include "similar.hpp"
 #include "progress.hpp"
-#include "async_manager.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 
 
 namespace
@@ -26,9 +21,15 @@ namespace
 	{
 		std::cerr <<
 "Synopsis: similar [options] [<source> [<destination>...]]\n"
+"          similar index build [options] <path>... -o <file>\n"
+"          similar merge [options] <partial>...\n"
 "\n"
 "Compare source with destination(s) and calculate similarity indices.\n"
 "\n"
+"Source or destination may be an index file written by 'similar index build'.\n"
+"Indexed files are compared using the stored digests and fingerprints, the\n"
+"original files are not read.\n"
+"\n"
 "If source and/or destination is directory then this directory is scanned\n"
 "recursively and all files inside are considered as source or destination\n"
 "respectively.\n"
@@ -59,12 +60,112 @@ namespace
 "    value range is [0 .. 1]. Default is 0.5.\n"
 "-a, --all\n"
 "    Display all sources with all destinations comparisons.\n"
+"--max-matches-per-file <count>\n"
+"    Keep at most <count> best matches per file while searching for the best\n"
+"    matches. Limits memory used for trees with many similar files, but the\n"
+"    best match of a file may be lost if it doesn't fit into the limit of\n"
+"    the other file. Default is 0 (no limit).\n"
+"--approx\n"
+"    Estimate similarity from a sample of spans (one of 16 hash values) of\n"
+"    each file first and compare files fully only if the estimate is close\n"
+"    to the minimum similarity. A pair may be missed if its estimate is too\n"
+"    low. With --all, pairs estimated well above the minimum similarity are\n"
+"    reported with the estimate. Best matches are always exact.\n"
+"--approx-margin <margin>\n"
+"    How far from the minimum similarity an estimate may be for the pair to\n"
+"    be compared fully with --approx. Default is 0.2.\n"
 "-o, --out <file>\n"
 "    Dump output to a given file instead of stdout. In this case stdout is used\n"
 "    to display a progress.\n"
 "-t, --text\n"
 "    Check similarity only for text files. Binary files are checked only for\n"
 "    exact match.\n"
+"--binary-chunks\n"
+"    Split binary files into content-defined chunks instead of fixed length\n"
+"    spans, so inserted or removed bytes don't change all following spans.\n"
+"    Index files and partial results must be written with the same setting.\n"
+"--sample-above <size>\n"
+"    Keep only a fixed sample of span hashes (one of 16 hash values) in\n"
+"    fingerprints of files of at least <size> bytes. Reduces memory use and\n"
+"    comparison time for huge files, their similarity is estimated. Default\n"
+"    is 0 (never sample).\n"
+"--compress-fingerprints\n"
+"    Keep fingerprints in memory compressed (2-3 bytes per entry instead of\n"
+"    12). Takes less memory for large trees and --serve indexes at the cost\n"
+"    of slower comparison.\n"
+"--cache <file>\n"
+"    Keep fingerprints of files in a given file. Files with unchanged size and\n"
+"    modification time are not read again.\n"
+"--append-only\n"
+"    Assume that files in cache are only appended to. Files that grew since\n"
+"    the previous run are read starting from their previous end.\n"
+"--watch\n"
+"    Keep running after the first report and watch sources and destinations\n"
+"    for changes. Only changed files are read and compared again, then the\n"
+"    report is repeated. Output file is rewritten on each report, on stdout\n"
+"    reports are separated by an empty line.\n"
+"--serve <socket>\n"
+"    Index destinations (or sources if there are no destinations) and answer\n"
+"    similarity queries on a given Unix domain socket. Each request is a line\n"
+"    'PATH <count> <path>' or 'DATA <count> <size>' followed by <size> bytes\n"
+"    of data. Up to <count> best matches are returned as '<index>|<name>'\n"
+"    lines followed by an empty line.\n"
+"--shard <index>/<count>\n"
+"    Compare only every <count>-th source starting from <index> (zero-based)\n"
+"    and write a partial result to the output file instead of the report.\n"
+"    Partial results of all shards are combined by 'similar merge' into the\n"
+"    same report a single run would produce.\n"
+"--stats <file>\n"
+"    Write per-step statistics (times, throughput, counters) to a given file\n"
+"    in JSON format.\n"
+#ifdef SIMILAR_TRACE
+"--trace <file>\n"
+"    Write timeline of worker threads and steps to a given file in Chrome trace\n"
+"    event format.\n"
+#endif
+"-h, --help\n"
+"    Show this help and exit.\n";
+	}
+
+	void showIndexHelp()
+	{
+		std::cerr <<
+"Synopsis: similar index build [options] <path>... -o <file>\n"
+"\n"
+"Read given files and directories and write their digests and fingerprints\n"
+"to an index file that can be used as source or destination later.\n"
+"\n"
+"Options:\n"
+"-S, --list [<prefix>:]<path>\n"
+"    Add files from the given file that contains a list of paths (one path\n"
+"    per line). Optional prefix is prepended to each path.\n"
+"-l, --follow-symlinks\n"
+"    Follow symlinks instead of treating them as links.\n"
+"-L, --dont-follow-symlinks\n"
+"    Don't follow symlinks and treat them as links. This is default.\n"
+"-o, --out <file>\n"
+"    Index file to write.\n"
+"--binary-chunks\n"
+"    Split binary files into content-defined chunks, see 'similar --help'.\n"
+"--sample-above <size>\n"
+"    Sample fingerprints of huge files, see 'similar --help'.\n"
+"--cache <file>\n"
+"    Keep fingerprints of files in a given file, see 'similar --help'.\n"
+"-h, --help\n"
+"    Show this help and exit.\n";
+	}
+
+	void showMergeHelp()
+	{
+		std::cerr <<
+"Synopsis: similar merge [options] <partial>...\n"
+"\n"
+"Combine partial results written by 'similar --shard' runs into a report.\n"
+"Results of all shards of the same run must be given.\n"
+"\n"
+"Options:\n"
+"-o, --out <file>\n"
+"    Dump output to a given file instead of stdout.\n"
 "-h, --help\n"
 "    Show this help and exit.\n";
 	}
@@ -77,462 +178,319 @@ namespace
 		return ss.rdstate() == std::ios_base::eofbit;
 	}
 
-	bool fileIsBinary(const char* fileName)
+	template<typename T>
+	const char* plural(T count, const char* postfix = "s")
 	{
-		std::ifstream stream(fileName, std::ios_base::in | std::ios_base::binary);
-		if(!stream.is_open())
+		if(count != 1)
 		{
-			throw std::runtime_error(std::string("failed to open file: '") + fileName + "'");
+			return postfix;
 		}
-
-		// read up to 1024 bytes
-		const size_t MAX_READ = 1024;
-		bool result = false;
-		for(size_t i = 0; i != MAX_READ; ++i)
+		else
 		{
-			int ch = stream.get();
-			if(ch == EOF)
-			{
-				break;
-			}
-
-			if(!std::isprint(ch) && !std::isspace(ch))
-			{
-				result = true;
-				break;
-			}
+			return "";
 		}
-
-		return result;
 	}
 
-	class FileDigest
+	class Step
 	{
 	public:
-		FileDigest()
-		{
-			memset(data_, 0, sizeof(data_));
-		}
-
-		FileDigest(const FileDigest& that)
-		{
-			memcpy(data_, that.data_, sizeof(data_));
-		}
-
-		FileDigest& operator=(const FileDigest& that)
-		{
-			memcpy(data_, that.data_, sizeof(data_));
-			return *this;
-		}
-
-		UINT_8* data()
-		{
-			return data_;
-		}
-
-		const UINT_8* data() const
+		explicit Step(unsigned total):
+			current_(0),
+			total_(total)
 		{
-			return data_;
 		}
 
-		size_t hash() const
+		std::string step(const char* title)
 		{
-			return *reinterpret_cast<const size_t*>(data_);
-		}
+			current_ += 1;
 
-		bool operator==(const FileDigest& that) const
-		{
-			return memcmp(data_, that.data_, sizeof(data_)) == 0;
-		}
+			std::stringstream ss;
+			ss << "[" << current_ << "/" << total_ << "] " << title;
 
-		bool operator!=(const FileDigest& that) const
-		{
-			return !(*this == that);
+			return ss.str();
 		}
 
 	private:
-		UINT_8 data_[20];
+		unsigned current_;
+		unsigned total_;
 
 	};
 
-	class FileInfo
+	int buildIndex(int argc, char** argv)
 	{
-	public:
-		struct Match
+		enum
 		{
-			Match(FileInfo* fileInfo, float similarity):
-				fileInfo(fileInfo),
-				similarity(similarity)
-			{
-			}
-
-			FileInfo* fileInfo;
-			float similarity;
+			OPT_CACHE = 256,
+			OPT_BINARY_CHUNKS,
+			OPT_SAMPLE_ABOVE
 		};
 
-		FileInfo(std::string&& name, size_t size):
-			name_(std::move(name)),
-			size_(size),
-			binary_(false),
-			digest_(),
-			spanHash_(),
-			spanHashRefs_(0),
-			matches_()
-		{
-		}
-
-		FileInfo(FileInfo&& that):
-			name_(std::move(that.name_)),
-			size_(that.size_),
-			binary_(that.binary_),
-			digest_(std::move(that.digest_)),
-			spanHash_(std::move(that.spanHash_)),
-			spanHashRefs_(that.spanHashRefs_),
-			matches_(std::move(that.matches_))
-		{
-			that.spanHashRefs_ = 0;
-		}
-
-		FileInfo& operator=(FileInfo&& that)
-		{
-			name_ = std::move(that.name_);
-			size_ = that.size_;
-			binary_ = that.binary_;
-			digest_ = std::move(that.digest_);
-			spanHash_ = std::move(that.spanHash_);
-			spanHashRefs_ = that.spanHashRefs_;
-			that.spanHashRefs_ = 0;
-			matches_ = std::move(that.matches_);
-		}
-
-		const std::string& name() const
-		{
-			return name_;
-		}
-
-		size_t size() const
-		{
-			return size_;
-		}
-
-		bool isBinary() const
-		{
-			return binary_;
-		}
-
-		const FileDigest& digest() const
-		{
-			return digest_;
-		}
-
-		const SpanHash& spanHash() const
-		{
-			return spanHash_;
-		}
-
-		void acquireSpanHash()
+		static const char short_options[] = "S:lLo:h";
+		static const option long_options[] =
 		{
-			if(spanHashRefs_ == -1)
 			{
-				// counter overflow, don't increment it further
-				return;
-			}
-
-			spanHashRefs_ += 1;
-
-			if(spanHashRefs_ == 1)
+				.name = "list",
+				.has_arg = required_argument,
+				.flag = nullptr,
+				.val = 'S'
+			},
 			{
-				spanHash_.init(name_.c_str(), binary_);
-			}
-		}
-
-		void releaseSpanHash()
-		{
-			if(spanHashRefs_ == -1)
+				.name = "follow-symlinks",
+				.has_arg = no_argument,
+				.flag = nullptr,
+				.val = 'l'
+			},
 			{
-				// counter overflow, don't ever release
-				return;
-			}
-
-			if(spanHashRefs_ > 0)
+				.name = "dont-follow-symlinks",
+				.has_arg = no_argument,
+				.flag = nullptr,
+				.val = 'L'
+			},
 			{
-				spanHashRefs_ -= 1;
-			}
-
-			if(spanHashRefs_ == 0)
+				.name = "out",
+				.has_arg = required_argument,
+				.flag = nullptr,
+				.val = 'o'
+			},
 			{
-				spanHash_.clear();
-			}
-		}
-
-		bool read()
-		{
-			// check if file is binary
-			binary_ = fileIsBinary(name_.c_str());
-
-			// calculate file digest
-			CSHA1 sha1;
-			if(!sha1.HashFile(name_.c_str()))
+				.name = "cache",
+				.has_arg = required_argument,
+				.flag = nullptr,
+				.val = OPT_CACHE
+			},
 			{
-				std::cerr << "ERROR: failed to read file: '" << name_ << "'" << std::endl;
-				return false;
-			}
-			sha1.Final();
-
-			sha1.GetHash(digest_.data());
-
-			return true;
-		}
-
-		bool addMatch(FileInfo* that, float similarity)
-		{
-			auto matchSortPredicate = [](const Match& l, const Match& r)
+				.name = "binary-chunks",
+				.has_arg = no_argument,
+				.flag = nullptr,
+				.val = OPT_BINARY_CHUNKS
+			},
 			{
-				return l.similarity > r.similarity;
-			};
-
-			// check if that file is already here
-			auto existing = std::find_if(matches_.begin(), matches_.end(), [that](const Match& match)
+				.name = "sample-above",
+				.has_arg = required_argument,
+				.flag = nullptr,
+				.val = OPT_SAMPLE_ABOVE
+			},
 			{
-				return match.fileInfo == that;
-			});
-
-			if(existing != matches_.end())
+				.name = "help",
+				.has_arg = no_argument,
+				.flag = nullptr,
+				.val = 'h'
+			},
 			{
-				return false;
+				.name = nullptr,
+				.has_arg = 0,
+				.flag = nullptr,
+				.val = 0
 			}
+		};
 
-			// find appropriate insertion position
-			const Match match(that, similarity);
-			auto pos = std::upper_bound(matches_.begin(), matches_.end(), match, matchSortPredicate);
-
-			// insert match
-			matches_.insert(pos, match);
-
-			that->addMatch(this, similarity);
-
-			return matches_.size() == 1; // we have added the first match
-		}
-
-		bool hasMatch() const
-		{
-			return !matches_.empty();
-		}
+		FileList files;
+		bool followSymlinks = false;
+		std::string outFile;
+		std::string cacheFile;
+		SpanHash::Options fingerprintOptions;
 
-		bool hasMatch(float similarity) const
+		while(true)
 		{
-			if(!matches_.empty())
+			int c = getopt_long(argc, argv, short_options, long_options, nullptr);
+			if(c < 0)
 			{
-				return matches_.front().similarity >= similarity;
-			}
-			else
-			{
-				return false;
+				break;
 			}
-		}
 
-		bool takeMatch(float& similarity, FileInfo*& source, FileInfo*& destination)
-		{
-			if(matches_.empty())
+			switch(c)
 			{
-				return false;
-			}
+			case 'S':
+				addListFile(files, optarg, followSymlinks);
+				break;
 
-			source = this;
+			case 'l':
+				followSymlinks = true;
+				break;
 
-			// find the first mutual match
-			for(size_t recursionCounter = 1000; recursionCounter != 0; --recursionCounter)
-			{
-				assert(!source->matches_.empty());
-				auto& sourceMatch = source->matches_.front();
+			case 'L':
+				followSymlinks = false;
+				break;
 
-				destination = sourceMatch.fileInfo;
-				assert(!destination->matches_.empty());
-				auto& destinationMatch = destination->matches_.front();
+			case 'o':
+				outFile = optarg;
+				break;
 
-				if(destinationMatch.fileInfo == source)
-				{
-					similarity = sourceMatch.similarity;
+			case OPT_CACHE:
+				cacheFile = optarg;
+				break;
 
-					source->clearMatches();
-					destination->clearMatches();
+			case OPT_BINARY_CHUNKS:
+				fingerprintOptions.binaryChunking = true;
+				break;
 
-					return true;
+			case OPT_SAMPLE_ABOVE:
+			{
+				uint64_t threshold = 0;
+				if(!lexicalCast(optarg, threshold) || optarg[0] == '-')
+				{
+					std::cerr << "ERROR: invalid sample-above value: " << optarg << std::endl;
+					showIndexHelp();
+					return 1;
 				}
-
-				source = destinationMatch.fileInfo;
+				fingerprintOptions.samplingThreshold = threshold;
+				break;
 			}
 
-			std::cerr << "ERROR: similarity chain seems to contain loop, this shouldn't have happen";
-			return false;
-		}
+			case 'h':
+				showIndexHelp();
+				return 0;
 
-	private:
-		std::string name_;
-		size_t size_;
-		bool binary_;
-		FileDigest digest_;
-		SpanHash spanHash_;
-		size_t spanHashRefs_;
-		std::vector<Match> matches_;
-
-		void removeMatch(FileInfo* that)
-		{
-			auto match = std::find_if(matches_.begin(), matches_.end(), [that](const Match& match)
-			{
-				return match.fileInfo == that;
-			});
-
-			if(match == matches_.end())
-			{
-				return;
+			default:
+				showIndexHelp();
+				return 1;
 			}
-
-			matches_.erase(match);
 		}
 
-		void clearMatches()
+		for(int i = optind; i < argc; ++i)
 		{
-			std::vector<Match> old;
-			matches_.swap(old);
-
-			for(const auto& match: old)
-			{
-				match.fileInfo->removeMatch(this);
-			}
+			addPath(files, argv[i], followSymlinks);
 		}
 
-	};
-
-	struct DigestIndexPred
-	{
-		bool operator()(FileInfo* lhs, FileInfo* rhs) const
+		if(outFile.empty())
 		{
-			return lhs->digest() == rhs->digest();
+			std::cerr << "ERROR: output file is not specified" << std::endl;
+			showIndexHelp();
+			return 1;
 		}
 
-		size_t operator()(FileInfo* v) const
+		if(files.empty())
 		{
-			return v->digest().hash();
+			std::cerr << "ERROR: file list is empty" << std::endl;
+			return 1;
 		}
-	};
-
-	typedef std::unordered_multiset<FileInfo*, DigestIndexPred, DigestIndexPred> DigestIndex;
 
-	template<typename T>
-	const char* plural(T count, const char* postfix = "s")
-	{
-		if(count != 1)
-		{
-			return postfix;
-		}
-		else
+		FingerprintCache cache(fingerprintOptions);
+		if(!cacheFile.empty() && !cache.load(cacheFile))
 		{
-			return "";
+			return 1;
 		}
-	}
 
-	class Step
-	{
-	public:
-		explicit Step(unsigned total):
-			current_(0),
-			total_(total)
-		{
-		}
+		Progress progress;
+		progress.setPrefix("Indexing files: ");
+		progress.setPostfix("%");
 
-		std::string step(const char* title)
+		bool ok = IndexFile::write(outFile, files, cacheFile.empty() ? nullptr : &cache, fingerprintOptions, [&progress](float current, float total)
 		{
-			current_ += 1;
+			progress.setCurrent(current);
+			progress.setTotal(total);
+			progress.update();
+		});
 
-			std::stringstream ss;
-			ss << "[" << current_ << "/" << total_ << "] " << title;
+		progress.flush();
+		std::cout << std::endl;
 
-			return ss.str();
+		if(!cacheFile.empty())
+		{
+			cache.save(cacheFile);
 		}
 
-	private:
-		unsigned current_;
-		unsigned total_;
-
-	};
-
-	typedef std::vector<FileInfo> FileList;
+		return ok ? 0 : 1;
+	}
 
-	void addPath(FileList& list, const char* path, bool followSymlinks)
+	int mergeShards(int argc, char** argv)
 	{
-		//std::cerr << "adding " << path << std::endl;
-		const Directory::Stat stat(path, followSymlinks);
-		switch(stat.fileType)
+		static const char short_options[] = "o:h";
+		static const option long_options[] =
 		{
-		case Directory::Stat::Directory:
-			for(auto f: DirectoryWalker(path, followSymlinks))
 			{
-				if(f.second.fileType == Directory::Stat::Regular)
-				{
-					//std::cerr << "found " << f.first << std::endl;
-					list.emplace_back(std::move(f.first), f.second.size);
-				}
+				.name = "out",
+				.has_arg = required_argument,
+				.flag = nullptr,
+				.val = 'o'
+			},
+			{
+				.name = "help",
+				.has_arg = no_argument,
+				.flag = nullptr,
+				.val = 'h'
+			},
+			{
+				.name = nullptr,
+				.has_arg = 0,
+				.flag = nullptr,
+				.val = 0
 			}
-			break;
-
-		case Directory::Stat::Regular:
-			//std::cerr << "file " << path << std::endl;
-			list.emplace_back(path, stat.size);
-			break;
+		};
 
-		}
-	}
+		std::string outFile;
 
-	bool xgetline(std::istream& stream, std::string& out)
-	{
-		bool nonEmpty = false;
-		for(int c = stream.get(); c != EOF; c = stream.get())
+		while(true)
 		{
-			if(c == '\r' || c == '\n')
+			int c = getopt_long(argc, argv, short_options, long_options, nullptr);
+			if(c < 0)
 			{
 				break;
 			}
 
-			out.push_back(c);
-			nonEmpty = true;
-		}
+			switch(c)
+			{
+			case 'o':
+				outFile = optarg;
+				break;
 
-		return nonEmpty;
-	}
+			case 'h':
+				showMergeHelp();
+				return 0;
 
-	void addListFile(FileList& list, const char* path, bool followSymlinks)
-	{
-		const char* colon = strchr(path, ':');
-		const char* p = colon ? colon + 1 : path;
+			default:
+				showMergeHelp();
+				return 1;
+			}
+		}
 
-		std::ifstream ifs(p, std::ios_base::in | std::ios_base::binary);
-		if(!ifs.good())
+		if(optind == argc)
 		{
-			std::cerr << "ERROR: failed to open file: '" << p << "'" << std::endl;
-			return;
+			std::cerr << "ERROR: no partial results given" << std::endl;
+			showMergeHelp();
+			return 1;
 		}
 
-		std::string f;
-		do
+		ShardResult result;
+		if(!result.load(argv[optind]))
 		{
-			if(colon)
-			{
-				f.assign(path, colon);
-			}
-			else
+			return 1;
+		}
+
+		for(int i = optind + 1; i < argc; ++i)
+		{
+			ShardResult shard;
+			if(!shard.load(argv[i]) || !result.merge(std::move(shard)))
 			{
-				f.clear();
+				return 1;
 			}
+		}
 
-			if(!xgetline(ifs, f))
+		if(!result.isComplete())
+		{
+			std::cerr << "ERROR: partial results of some shards are missing" << std::endl;
+			return 1;
+		}
+
+		std::ofstream outStream;
+		if(!outFile.empty())
+		{
+			outStream.open(outFile, std::ios_base::out | std::ios_base::trunc);
+			if(!outStream.is_open())
 			{
-				continue;
+				std::cerr << "ERROR: failed to open file: " << outFile << std::endl;
+				return 1;
 			}
-
-			addPath(list, f.c_str(), followSymlinks);
 		}
-		while(ifs.good());
+
+		std::ostream& out = outFile.empty() ? std::cout : outStream;
+
+		result.report([&out](float similarity, const FileInfo& src, const FileInfo& dst)
+		{
+			out << similarity << "|" << src.name() << "|" << dst.name() << std::endl;
+		});
+
+		return 0;
 	}
 
 }
@@ -540,8 +498,36 @@ namespace
 
 int main(int argc, char** argv)
 {
+	if(argc > 2 && strcmp(argv[1], "index") == 0 && strcmp(argv[2], "build") == 0)
+	{
+		// "build" takes place of the program name for the options parser
+		return buildIndex(argc - 2, argv + 2);
+	}
+
+	if(argc > 1 && strcmp(argv[1], "merge") == 0)
+	{
+		return mergeShards(argc - 1, argv + 1);
+	}
+
 	// parse options
 
+	enum
+	{
+		OPT_STATS = 256,
+		OPT_TRACE,
+		OPT_CACHE,
+		OPT_APPEND_ONLY,
+		OPT_WATCH,
+		OPT_SERVE,
+		OPT_MAX_MATCHES,
+		OPT_SHARD,
+		OPT_BINARY_CHUNKS,
+		OPT_SAMPLE_ABOVE,
+		OPT_COMPRESS_FINGERPRINTS,
+		OPT_APPROX,
+		OPT_APPROX_MARGIN
+	};
+
 	static const char short_options[] = "s:d:S:D:lLm:ao:th";
 	static const option long_options[] =
 	{
@@ -593,6 +579,24 @@ int main(int argc, char** argv)
 			.flag = nullptr,
 			.val = 'a'
 		},
+		{
+			.name = "max-matches-per-file",
+			.has_arg = required_argument,
+			.flag = nullptr,
+			.val = OPT_MAX_MATCHES
+		},
+		{
+			.name = "approx",
+			.has_arg = no_argument,
+			.flag = nullptr,
+			.val = OPT_APPROX
+		},
+		{
+			.name = "approx-margin",
+			.has_arg = required_argument,
+			.flag = nullptr,
+			.val = OPT_APPROX_MARGIN
+		},
 		{
 			.name = "out",
 			.has_arg = required_argument,
@@ -605,6 +609,68 @@ int main(int argc, char** argv)
 			.flag = nullptr,
 			.val = 't'
 		},
+		{
+			.name = "binary-chunks",
+			.has_arg = no_argument,
+			.flag = nullptr,
+			.val = OPT_BINARY_CHUNKS
+		},
+		{
+			.name = "sample-above",
+			.has_arg = required_argument,
+			.flag = nullptr,
+			.val = OPT_SAMPLE_ABOVE
+		},
+		{
+			.name = "compress-fingerprints",
+			.has_arg = no_argument,
+			.flag = nullptr,
+			.val = OPT_COMPRESS_FINGERPRINTS
+		},
+		{
+			.name = "cache",
+			.has_arg = required_argument,
+			.flag = nullptr,
+			.val = OPT_CACHE
+		},
+		{
+			.name = "append-only",
+			.has_arg = no_argument,
+			.flag = nullptr,
+			.val = OPT_APPEND_ONLY
+		},
+		{
+			.name = "watch",
+			.has_arg = no_argument,
+			.flag = nullptr,
+			.val = OPT_WATCH
+		},
+		{
+			.name = "serve",
+			.has_arg = required_argument,
+			.flag = nullptr,
+			.val = OPT_SERVE
+		},
+		{
+			.name = "shard",
+			.has_arg = required_argument,
+			.flag = nullptr,
+			.val = OPT_SHARD
+		},
+		{
+			.name = "stats",
+			.has_arg = required_argument,
+			.flag = nullptr,
+			.val = OPT_STATS
+		},
+#ifdef SIMILAR_TRACE
+		{
+			.name = "trace",
+			.has_arg = required_argument,
+			.flag = nullptr,
+			.val = OPT_TRACE
+		},
+#endif
 		{
 			.name = "help",
 			.has_arg = no_argument,
@@ -622,8 +688,20 @@ int main(int argc, char** argv)
 	float minSimilarity = 0.5f;
 	bool all = false;
 	bool exactOnly = false;
+	size_t maxMatchesPerFile = 0;
+	bool approx = false;
+	float approxMargin = 0.2f;
 	std::string outFile;
 	bool textOnly = false;
+	SpanHash::Options fingerprintOptions;
+	std::string statsFile;
+	std::string traceFile;
+	std::string cacheFile;
+	bool appendOnly = false;
+	bool watch = false;
+	std::string socketPath;
+	size_t shardIndex = 0;
+	size_t shardCount = 0; // not sharded
 
 	while(true)
 	{
@@ -647,15 +725,37 @@ int main(int argc, char** argv)
 		case 'm':
 			if(!lexicalCast(optarg, minSimilarity) || minSimilarity < 0.0f || minSimilarity > 1.0f)
 			{
-				std::cerr << "ERROR: invalid min-similarity value: " << optarg << std::endl;
+				std::cerr << "ERROR: invalid min-similarity value: " << optarg << std::endl;
+				showHelp();
+				return 1;
+			}
+			exactOnly = (minSimilarity >= 1.0f);
+			break;
+
+		case 'a':
+			all = true;
+			break;
+
+		case OPT_MAX_MATCHES:
+			if(!lexicalCast(optarg, maxMatchesPerFile) || optarg[0] == '-')
+			{
+				std::cerr << "ERROR: invalid max-matches-per-file value: " << optarg << std::endl;
 				showHelp();
 				return 1;
 			}
-			exactOnly = (minSimilarity >= 1.0f);
 			break;
 
-		case 'a':
-			all = true;
+		case OPT_APPROX:
+			approx = true;
+			break;
+
+		case OPT_APPROX_MARGIN:
+			if(!lexicalCast(optarg, approxMargin) || approxMargin < 0.0f || approxMargin > 1.0f)
+			{
+				std::cerr << "ERROR: invalid approx-margin value: " << optarg << std::endl;
+				showHelp();
+				return 1;
+			}
 			break;
 
 		case 'o':
@@ -666,6 +766,65 @@ int main(int argc, char** argv)
 			textOnly = true;
 			break;
 
+		case OPT_BINARY_CHUNKS:
+			fingerprintOptions.binaryChunking = true;
+			break;
+
+		case OPT_SAMPLE_ABOVE:
+			if(!lexicalCast(optarg, fingerprintOptions.samplingThreshold) || optarg[0] == '-')
+			{
+				std::cerr << "ERROR: invalid sample-above value: " << optarg << std::endl;
+				showHelp();
+				return 1;
+			}
+			break;
+
+		case OPT_COMPRESS_FINGERPRINTS:
+			fingerprintOptions.compression = true;
+			break;
+
+		case OPT_STATS:
+			statsFile = optarg;
+			break;
+
+		case OPT_TRACE:
+			traceFile = optarg;
+			break;
+
+		case OPT_CACHE:
+			cacheFile = optarg;
+			break;
+
+		case OPT_APPEND_ONLY:
+			appendOnly = true;
+			break;
+
+		case OPT_WATCH:
+			watch = true;
+			break;
+
+		case OPT_SERVE:
+			socketPath = optarg;
+			break;
+
+		case OPT_SHARD:
+		{
+			const char* slash = strchr(optarg, '/');
+			if(
+				!slash ||
+				optarg[0] == '-' ||
+				slash[1] == '-' ||
+				!lexicalCast(std::string(optarg, slash - optarg).c_str(), shardIndex) ||
+				!lexicalCast(slash + 1, shardCount) ||
+				shardIndex >= shardCount)
+			{
+				std::cerr << "ERROR: invalid shard value: " << optarg << std::endl;
+				showHelp();
+				return 1;
+			}
+			break;
+		}
+
 		case 'h':
 			showHelp();
 			return 0;
@@ -676,9 +835,23 @@ int main(int argc, char** argv)
 		}
 	}
 
+	const bool shard = (shardCount != 0);
+	if(shard && outFile.empty())
+	{
+		std::cerr << "ERROR: partial result of a shard requires output file" << std::endl;
+		showHelp();
+		return 1;
+	}
+
+	if(shard && (watch || !socketPath.empty()))
+	{
+		std::cerr << "ERROR: --shard can't be used with --watch or --serve" << std::endl;
+		return 1;
+	}
+
 	std::ofstream outStream;
 	bool showProgress = !outFile.empty();
-	if(showProgress)
+	if(showProgress && !shard)
 	{
 		outStream.open(outFile, std::ios_base::out | std::ios_base::trunc);
 		if(!outStream.is_open())
@@ -689,8 +862,15 @@ int main(int argc, char** argv)
 
 	std::ostream& out = outFile.empty() ? std::cout : outStream;
 
+	Stats::setEnabled(!statsFile.empty());
+
+#ifdef SIMILAR_TRACE
+	Trace::setEnabled(!traceFile.empty());
+	TRACE_THREAD_NAME("main");
+#endif
+
 	unsigned totalSteps = 5;
-	if(all)
+	if(all && !shard)
 	{
 		totalSteps -= 1;
 	}
@@ -705,16 +885,43 @@ int main(int argc, char** argv)
 
 	// 1. List files
 
+	Stats::beginStep("Listing files");
+
 	if(showProgress)
 	{
 		std::cout << step.step("Listing files...") << std::flush;
 	}
 
+	// index files must outlive file lists referring to them
+	std::vector<std::unique_ptr<IndexFile>> indexFiles;
+
 	FileList source;
 	FileList destination_storage;
 	bool haveDestination = false;
 	bool followSymlinks = false;
 
+	auto addInput = [&indexFiles, &followSymlinks, &fingerprintOptions](FileList& list, const char* path)
+	{
+		if(!IndexFile::isIndexFile(path))
+		{
+			addPath(list, path, followSymlinks);
+			return true;
+		}
+
+		indexFiles.emplace_back(new IndexFile());
+		if(!indexFiles.back()->open(path, fingerprintOptions))
+		{
+			return false;
+		}
+
+		indexFiles.back()->addFiles(list);
+		return true;
+	};
+
+	// paths the lists were populated from, needed to watch them
+	std::vector<std::string> sourceRoots;
+	std::vector<std::string> destinationRoots;
+
 	optind = 1; // restart options parser
 	while(true)
 	{
@@ -727,20 +934,28 @@ int main(int argc, char** argv)
 		switch(c)
 		{
 		case 's':
-			addPath(source, optarg, followSymlinks);
+			if(!addInput(source, optarg))
+			{
+				return 1;
+			}
+			sourceRoots.push_back(optarg);
 			break;
 
 		case 'd':
-			addPath(destination_storage, optarg, followSymlinks);
+			if(!addInput(destination_storage, optarg))
+			{
+				return 1;
+			}
+			destinationRoots.push_back(optarg);
 			haveDestination = true;
 			break;
 
 		case 'S':
-			addListFile(source, optarg, followSymlinks);
+			addListFile(source, optarg, followSymlinks, &sourceRoots);
 			break;
 
 		case 'D':
-			addListFile(destination_storage, optarg, followSymlinks);
+			addListFile(destination_storage, optarg, followSymlinks, &destinationRoots);
 			haveDestination = true;
 			break;
 
@@ -760,7 +975,12 @@ int main(int argc, char** argv)
 	for(int i = optind; i < argc; ++i)
 	{
 		FileList& list = (i > optind) ? destination_storage : source;
-		addPath(list, argv[i], followSymlinks);
+		if(!addInput(list, argv[i]))
+		{
+			return 1;
+		}
+
+		((i > optind) ? destinationRoots : sourceRoots).push_back(argv[i]);
 	}
 
 	FileList& destination = haveDestination ? destination_storage : source;
@@ -772,7 +992,7 @@ int main(int argc, char** argv)
 			<< destination.size() << " destination" << plural(destination.size()) << std::endl;
 	}
 
-	if(source.empty())
+	if(source.empty() && (socketPath.empty() || !haveDestination))
 	{
 		std::cerr << "ERROR: source file list is empty" << std::endl;
 		return 1;
@@ -786,240 +1006,227 @@ int main(int argc, char** argv)
 
 	// 2. Hash files
 
-	DigestIndex destinationDigestIndex;
+	Stats::beginStep("Hashing files");
+
+	FingerprintCache cache(fingerprintOptions);
+	cache.setAppendOnly(appendOnly);
+	if(!cacheFile.empty() && !cache.load(cacheFile))
+	{
+		return 1;
+	}
+
+	Matcher::Options options;
+	options.minSimilarity = minSimilarity;
+	options.all = all;
+	options.textOnly = textOnly;
+	options.maxMatchesPerFile = maxMatchesPerFile;
+	options.approx = approx;
+	options.approxMargin = approxMargin;
+	options.fingerprint = fingerprintOptions;
+	options.cache = cacheFile.empty() ? nullptr : &cache;
+	if(shard)
+	{
+		options.shardIndex = shardIndex;
+		options.shardCount = shardCount;
+	}
+
+	auto printMatch = [&out](float similarity, const FileInfo& src, const FileInfo& dst)
+	{
+		out << similarity << "|" << src.name() << "|" << dst.name() << std::endl;
+	};
 
+	if(!socketPath.empty())
 	{
+		QueryServer server(destination, options);
+
 		if(showProgress)
 		{
-			progress.setPrefix(step.step("Hashing files: "));
-			progress.setPostfix("%");
-			progress.setCurrent(0.0f);
-			progress.setTotal(source.size() + destination_storage.size());
-			progress.update();
+			std::cout << step.step("Loading index...") << std::flush;
 		}
 
-		size_t fileIndex = 0;
+		server.load();
 
-		destinationDigestIndex.reserve(destination.size());
-
-		for(int i = 0; i < 2; ++i)
+		if(!cacheFile.empty())
 		{
-			const bool dest = (i > 0);
-			FileList& list = dest ? destination_storage : source;
-			for(auto& fi: list)
-			{
-				bool ok = fi.read();
-				if(&list == &destination && ok)
-				{
-					// add file to digest index
-					destinationDigestIndex.insert(&fi);
-				}
-
-				if(showProgress)
-				{
-					fileIndex += 1;
-					progress.setCurrent(fileIndex);
-					progress.update();
-				}
-			}
+			cache.save(cacheFile);
 		}
 
 		if(showProgress)
 		{
-			progress.setCurrent(progress.total());
-			progress.flush();
-			std::cout << std::endl;
+			std::cout << " done" << std::endl;
 		}
-	}
 
-	// 3. Search exact matches
+		if(!server.listen(socketPath))
+		{
+			return 1;
+		}
+
+		server.run();
+
+		return 1;
+	}
 
+	if(watch)
 	{
+		WatchIndex index(source, destination, cache, options, followSymlinks);
+
+		for(const auto& root: sourceRoots)
+		{
+			index.addRoot(root, true);
+		}
+
+		for(const auto& root: destinationRoots)
+		{
+			index.addRoot(root, !haveDestination);
+		}
+
+		if(!index.watch())
+		{
+			return 1;
+		}
+
 		if(showProgress)
 		{
-			progress.setPrefix(step.step("Searching exact matches: "));
-			progress.setPostfix("%");
-			progress.setCurrent(0.0f);
-			progress.setTotal(source.size());
-			progress.update();
+			std::cout << step.step("Building index...") << std::flush;
 		}
 
-		size_t matchesCount = 0;
+		index.build();
 
-		for(size_t srcIndex = 0; srcIndex != source.size(); ++srcIndex)
+		if(showProgress)
 		{
-			auto& src = source[srcIndex];
+			std::cout << " done" << std::endl;
+		}
 
-			if(!all && src.hasMatch())
+		while(true)
+		{
+			if(!cacheFile.empty())
 			{
-				// skip already matched file
-				continue;
+				cache.save(cacheFile);
 			}
 
-			auto dstRange = destinationDigestIndex.equal_range(&src);
-			for(auto dstIt = dstRange.first; dstIt != dstRange.second; ++dstIt)
-			{
-				auto& dst = **dstIt;
-
-				if(src.name() == dst.name())
-				{
-					// don't compare the file with itself
-					continue;
-				}
-
-				if(all)
-				{
-					out << "1|" << src.name() << "|" << dst.name() << std::endl;
-					matchesCount += 1;
-					continue;
-				}
+			index.report(printMatch);
 
-				if(dst.hasMatch())
-				{
-					// skip already processed file
-					continue;
-				}
+			if(showProgress)
+			{
+				outStream.flush();
+				std::cout << "Watching for changes..." << std::endl;
+			}
 
-				src.addMatch(&dst, 1.0f);
-				matchesCount += 1;
-				break;
+			while(!index.update(-1))
+			{
 			}
 
 			if(showProgress)
 			{
-				progress.setCurrent(srcIndex + 1);
-				progress.update();
+				// rewrite the whole report
+				outStream.close();
+				outStream.open(outFile, std::ios_base::out | std::ios_base::trunc);
+			}
+			else
+			{
+				out << std::endl;
 			}
 		}
+	}
 
-		if(showProgress)
+	Matcher matcher(source, destination, options);
+
+	if(showProgress)
+	{
+		matcher.setProgressCallback([&progress](float current, float total)
 		{
-			progress.setCurrent(progress.total());
-			progress.flush();
-			std::cout << ", found " << matchesCount << " exact match" << plural(matchesCount, "es") << std::endl;
-		}
+			progress.setCurrent(current);
+			progress.setTotal(total);
+			progress.update();
+		});
 	}
 
-	if(!exactOnly)
+	// shards report nothing, exact matches are searched again on merge
+	if(!shard)
 	{
-		// 4. Find similar files
+		matcher.setMatchCallback(printMatch);
+	}
+
+	{
+		TRACE_SCOPE("Hashing files");
 
 		if(showProgress)
 		{
-			progress.setPrefix(step.step("Searching similar files: "));
+			progress.setPrefix(step.step("Hashing files: "));
 			progress.setPostfix("%");
 			progress.setCurrent(0.0f);
-			progress.setTotal(static_cast<float>(source.size()) * destination.size());
+			progress.setTotal(source.size() + destination_storage.size());
 			progress.update();
 		}
 
-		size_t matchesCount = 0;
+		matcher.hash();
 
-		for(size_t srcIndex = 0; srcIndex != source.size(); ++srcIndex)
+		if(!cacheFile.empty())
 		{
-			auto& src = source[srcIndex];
+			cache.save(cacheFile);
+		}
 
-			if(textOnly && src.isBinary())
-			{
-				// skip binaries
-				continue;
-			}
+		if(showProgress)
+		{
+			progress.setCurrent(progress.total());
+			progress.flush();
+			std::cout << std::endl;
+		}
+	}
 
-			if(!all && src.hasMatch(1.0f))
-			{
-				// skip files with exact match
-				continue;
-			}
+	// 3. Search exact matches
 
-			src.acquireSpanHash(); // extra reference to avoid races inside loop
+	Stats::beginStep("Searching exact matches");
 
-			for(size_t dstIndex = 0; dstIndex != destination.size(); ++dstIndex)
-			{
-				auto& dst = destination[dstIndex];
+	{
+		TRACE_SCOPE("Searching exact matches");
 
-				if(textOnly && dst.isBinary())
-				{
-					// skip binaries
-					continue;
-				}
+		if(showProgress)
+		{
+			progress.setPrefix(step.step("Searching exact matches: "));
+			progress.setPostfix("%");
+			progress.setCurrent(0.0f);
+			progress.setTotal(source.size());
+			progress.update();
+		}
 
-				if(!all && dst.hasMatch(1.0f))
-				{
-					// skip files with exact match
-					continue;
-				}
+		size_t matchesCount = matcher.findExactMatches();
 
-				if(src.digest() == dst.digest())
-				{
-					// skip exact matches
-					continue;
-				}
+		if(showProgress)
+		{
+			progress.setCurrent(progress.total());
+			progress.flush();
+			std::cout << ", found " << matchesCount << " exact match" << plural(matchesCount, "es") << std::endl;
+		}
+	}
 
-				if(src.name() == dst.name())
-				{
-					// don't compare the file with itself
-					continue;
-				}
+	Matcher::Edges shardPairs;
 
-				// check file sizes
-				const size_t minSize = std::min(src.size(), dst.size());
-				const size_t maxSize = std::max(src.size(), dst.size());
-				const float maxSimilarity = static_cast<float>(minSize) / maxSize * 2.0f; // take LF & CRLF equivalence into account
-				if(maxSimilarity < minSimilarity)
-				{
-					// maximum possible similarity is below limit
-					continue;
-				}
+	if(!exactOnly)
+	{
+		// 4. Find similar files
 
-				src.acquireSpanHash();
-				dst.acquireSpanHash();
-				if(!src.spanHash().isValid() || !dst.spanHash().isValid())
-				{
-					continue;
-				}
+		Stats::beginStep("Searching similar files");
+		TRACE_SCOPE("Searching similar files");
 
-				AsyncManager::async(false, [&, srcIndex, dstIndex]
-				{
-					// exact matches were found before so these files can't be exactly the same
-					auto similarity = src.spanHash().compare(dst.spanHash()) * 0.99f;
-
-					AsyncManager::sync([&, srcIndex, dstIndex, similarity]
-					{
-						src.releaseSpanHash();
-						// dst.releaseSpanHash(); // don't release dst to avoid its re-read by the next src
-
-						if(similarity >= minSimilarity)
-						{
-							if(all)
-							{
-								out << similarity << "|" << src.name() << "|" << dst.name() << std::endl;
-								matchesCount += 1;
-							}
-							else
-							{
-								if(src.addMatch(&dst, similarity))
-								{
-									matchesCount += 1;
-								}
-							}
-						}
-
-						if(showProgress)
-						{
-							auto cur = std::max(progress.current(), static_cast<float>(destination.size()) * srcIndex + dstIndex + 1);
-							progress.setCurrent(cur);
-							progress.update();
-						}
-					});
-				});
-
-				AsyncManager::tick();
-			}
+		if(showProgress)
+		{
+			progress.setPrefix(step.step("Searching similar files: "));
+			progress.setPostfix("%");
+			progress.setCurrent(0.0f);
+			progress.setTotal(static_cast<float>(source.size()) * destination.size());
+			progress.update();
+		}
 
-			src.releaseSpanHash(); // release extra reference
+		if(shard && all)
+		{
+			matcher.setMatchCallback([&shardPairs, &source, &destination](float similarity, const FileInfo& src, const FileInfo& dst)
+			{
+				shardPairs.emplace_back(similarity, &src - source.data(), &dst - destination.data());
+			});
 		}
 
-		AsyncManager::syncAll();
+		size_t matchesCount = matcher.findSimilarFiles();
 
 		if(showProgress)
 		{
@@ -1029,9 +1236,37 @@ int main(int argc, char** argv)
 		}
 	}
 
-	if(!all)
+	if(shard)
+	{
+		// 5. Write partial result
+
+		Stats::beginStep("Writing partial result");
+		TRACE_SCOPE("Writing partial result");
+
+		if(showProgress)
+		{
+			std::cout << step.step("Writing partial result...") << std::flush;
+		}
+
+		ShardResult result;
+		result.assign(options, source, destination, all ? std::move(shardPairs) : matcher.similarPairs());
+		if(!result.save(outFile))
+		{
+			return 1;
+		}
+
+		if(showProgress)
+		{
+			std::cout << " done" << std::endl;
+		}
+	}
+	else if(!all)
 	{
 		// 5. Dump matches
+
+		Stats::beginStep("Dumping matches");
+		TRACE_SCOPE("Dumping matches");
+
 		if(showProgress)
 		{
 			progress.setPrefix(step.step("Dumping matches: "));
@@ -1041,24 +1276,7 @@ int main(int argc, char** argv)
 			progress.update();
 		}
 
-		for(size_t srcIndex = 0; srcIndex != source.size(); ++srcIndex)
-		{
-			auto& src = source[srcIndex];
-
-			float sim = 0.0f;
-			FileInfo* s = nullptr;
-			FileInfo* d = nullptr;
-			while(src.takeMatch(sim, s, d))
-			{
-				out << sim << "|" << s->name() << "|" << d->name() << std::endl;
-
-				if(showProgress)
-				{
-					progress.setCurrent(srcIndex + 1);
-					progress.update();
-				}
-			}
-		}
+		matcher.dumpMatches();
 
 		if(showProgress)
 		{
@@ -1068,6 +1286,18 @@ int main(int argc, char** argv)
 		}
 	}
 
+	if(!statsFile.empty())
+	{
+		Stats::write(statsFile);
+	}
+
+#ifdef SIMILAR_TRACE
+	if(!traceFile.empty())
+	{
+		Trace::write(traceFile);
+	}
+#endif
+
 	return 0;
 }
 
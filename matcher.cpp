@@ -0,0 +1,1429 @@
+#include "matcher.hpp"
+#include "async_manager.hpp"
+#include "directory.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+
+namespace
+{
+
+	// smaller edge lists are sorted by one worker
+	const size_t MIN_SORT_CHUNK = 64 * 1024;
+
+	// groups of files are compared in square tiles of this size
+	const size_t TILE_SIZE = 64;
+
+	// edge lists are pruned when they grow this many times above the limit
+	const size_t PRUNE_FACTOR = 2;
+
+	// best first, ties are resolved by positions to keep results stable
+	bool isBetter(const Matcher::Edge& lhs, const Matcher::Edge& rhs)
+	{
+		if(lhs.similarity != rhs.similarity)
+		{
+			return lhs.similarity > rhs.similarity;
+		}
+
+		if(lhs.source != rhs.source)
+		{
+			return lhs.source < rhs.source;
+		}
+
+		return lhs.destination < rhs.destination;
+	}
+
+	/**
+	Device and inode of a file, the same for all paths of it.
+	*/
+	typedef std::pair<uint64_t, uint64_t> FileId;
+
+	struct FileIdHash
+	{
+		size_t operator()(const FileId& v) const
+		{
+			return std::hash<uint64_t>()(v.first * 0x9e3779b97f4a7c15ull ^ v.second);
+		}
+	};
+
+	typedef std::vector<size_t> Group;
+	typedef std::vector<Group> Groups;
+
+	/**
+	Positions of files in `indices` grouped by their digests, groups and
+	positions inside them keep the order of `indices`.
+	*/
+	Groups groupByDigest(FileList& list, const std::vector<size_t>& indices)
+	{
+		Groups result;
+		std::unordered_map<FileInfo*, size_t, DigestIndexPred, DigestIndexPred> groupOf;
+		groupOf.reserve(indices.size());
+
+		for(size_t pos = 0; pos != indices.size(); ++pos)
+		{
+			auto inserted = groupOf.insert(std::make_pair(&list[indices[pos]], result.size()));
+			if(inserted.second)
+			{
+				result.emplace_back();
+			}
+
+			result[inserted.first->second].push_back(pos);
+		}
+
+		return result;
+	}
+
+	/**
+	Fields the candidate filter reads for every pair, taken from the first
+	file of each group into contiguous arrays so the filter streams through
+	them instead of touching a FileInfo per pair. Empty groups get zeros.
+	*/
+	struct GroupFields
+	{
+		std::vector<size_t> digests; // FileDigest::hash(), equal for equal digests
+		std::vector<uint64_t> sizes;
+	};
+
+	GroupFields collectFields(const FileList& list, const std::vector<std::vector<size_t>>& groups)
+	{
+		GroupFields result;
+		result.digests.reserve(groups.size());
+		result.sizes.reserve(groups.size());
+
+		for(const auto& members: groups)
+		{
+			const bool empty = members.empty();
+			result.digests.push_back(empty ? 0 : list[members.front()].digest().hash());
+			result.sizes.push_back(empty ? 0 : list[members.front()].size());
+		}
+
+		return result;
+	}
+
+	// upper bound of similarity of files of these sizes, twice their ratio
+	// because LF and CRLF files are equivalent
+	float sizeBound(uint64_t size1, uint64_t size2)
+	{
+		const uint64_t minSize = std::min(size1, size2);
+		const uint64_t maxSize = std::max(size1, size2);
+		return static_cast<float>(minSize) / maxSize * 2.0f;
+	}
+
+	/**
+	Destination of a source with the upper bound of their similarity.
+	*/
+	struct Candidate
+	{
+		float bound;
+		uint32_t destination;
+		uint32_t group; // group of files with the destination contents
+	};
+
+	// greater bounds first, ties are resolved by positions to keep the
+	// order stable
+	bool isMoreLikely(const Candidate& lhs, const Candidate& rhs)
+	{
+		if(lhs.bound != rhs.bound)
+		{
+			return lhs.bound > rhs.bound;
+		}
+
+		return lhs.destination < rhs.destination;
+	}
+
+	/**
+	Two greatest similarity bounds of a file over all its candidate pairs,
+	the first one with the other file of its pair.
+	*/
+	struct TopBounds
+	{
+		TopBounds():
+			first(-1.0f),
+			second(-1.0f),
+			partner(0)
+		{
+		}
+
+		void offer(float bound, uint32_t file)
+		{
+			if(bound > first)
+			{
+				second = first;
+				first = bound;
+				partner = file;
+			}
+			else if(bound > second)
+			{
+				second = bound;
+			}
+		}
+
+		// greatest bound of pairs except the one with `file`
+		float other(uint32_t file) const
+		{
+			return (partner == file) ? second : first;
+		}
+
+		float first;
+		float second;
+		uint32_t partner;
+	};
+
+	/**
+	Pairs of each file of a list as positions in the edge list, in the order
+	of the edge list.
+	*/
+	class PairLists
+	{
+	public:
+		PairLists():
+			selfCompare_(false),
+			sourceSide_(false),
+			begins_(),
+			pairs_()
+		{
+		}
+
+		/**
+		Files are sources of the pairs if `sourceSide`, destinations
+		otherwise. In self comparison each pair is listed for both its files.
+		*/
+		PairLists(const Matcher::Edges& edges, size_t fileCount, bool selfCompare, bool sourceSide):
+			selfCompare_(selfCompare),
+			sourceSide_(sourceSide),
+			begins_(fileCount + 1, 0),
+			pairs_()
+		{
+			uint32_t files[2];
+			for(const auto& edge: edges)
+			{
+				for(size_t j = 0, n = filesOf(edge, files); j != n; ++j)
+				{
+					begins_[files[j] + 1] += 1;
+				}
+			}
+
+			for(size_t i = 0; i != fileCount; ++i)
+			{
+				begins_[i + 1] += begins_[i];
+			}
+
+			pairs_.resize(begins_[fileCount]);
+			std::vector<size_t> ends(begins_.begin(), begins_.end() - 1);
+			for(size_t i = 0; i != edges.size(); ++i)
+			{
+				for(size_t j = 0, n = filesOf(edges[i], files); j != n; ++j)
+				{
+					pairs_[ends[files[j]]++] = i;
+				}
+			}
+		}
+
+		size_t size(size_t file) const
+		{
+			return begins_[file + 1] - begins_[file];
+		}
+
+		size_t at(size_t file, size_t pos) const
+		{
+			return pairs_[begins_[file] + pos];
+		}
+
+		// the other file of a pair of `file`
+		uint32_t other(const Matcher::Edge& edge, size_t file) const
+		{
+			if(selfCompare_)
+			{
+				return (edge.source == file) ? edge.destination : edge.source;
+			}
+
+			return sourceSide_ ? edge.destination : edge.source;
+		}
+
+	private:
+		bool selfCompare_;
+		bool sourceSide_;
+		std::vector<size_t> begins_;
+		std::vector<size_t> pairs_;
+
+		// files of the list the pair is listed for, returns their number
+		size_t filesOf(const Matcher::Edge& edge, uint32_t* files) const
+		{
+			if(selfCompare_)
+			{
+				files[0] = edge.source;
+				files[1] = edge.destination;
+				return 2;
+			}
+
+			files[0] = sourceSide_ ? edge.source : edge.destination;
+			return 1;
+		}
+
+	};
+
+	/**
+	Keep up to `limit` best edges in the heap, the worst one is on top.
+	*/
+	void offer(Matcher::Edges& heap, const Matcher::Edge& edge, size_t limit)
+	{
+		if(heap.size() < limit)
+		{
+			heap.push_back(edge);
+			std::push_heap(heap.begin(), heap.end(), isBetter);
+		}
+		else if(isBetter(edge, heap.front()))
+		{
+			std::pop_heap(heap.begin(), heap.end(), isBetter);
+			heap.back() = edge;
+			std::push_heap(heap.begin(), heap.end(), isBetter);
+		}
+	}
+
+}
+
+
+Matcher::Matcher(FileList& source, FileList& destination, const Options& options):
+	source_(source),
+	destination_(destination),
+	options_(options),
+	progressCallback_(),
+	matchCallback_(),
+	destinationDigestIndex_(),
+	edges_(),
+	sourceExact_(),
+	destinationExact_(),
+	sourceBest_(),
+	destinationBest_()
+{
+}
+
+
+void Matcher::setOptions(const Options& v)
+{
+	options_ = v;
+}
+
+
+void Matcher::setProgressCallback(const ProgressCallback& v)
+{
+	progressCallback_ = v;
+}
+
+
+void Matcher::setMatchCallback(const MatchCallback& v)
+{
+	matchCallback_ = v;
+}
+
+
+void Matcher::hash()
+{
+	const bool selfCompare = (&source_ == &destination_);
+	const float total = source_.size() + (selfCompare ? 0 : destination_.size());
+
+	size_t fileIndex = 0;
+
+	destinationDigestIndex_.clear();
+	destinationDigestIndex_.reserve(destination_.size());
+
+	// each file is read once, its other paths in both lists (the same path
+	// given twice or hard links) share its digest and fingerprint
+	std::unordered_map<FileId, FileInfo*, FileIdHash> readFiles;
+	readFiles.reserve(total);
+
+	for(int i = 0; i < 2; ++i)
+	{
+		const bool dest = (i > 0);
+		if(dest && selfCompare)
+		{
+			break;
+		}
+
+		FileList& list = dest ? destination_ : source_;
+		for(auto& fi: list)
+		{
+			const Directory::Stat stat = fi.isIndexed() ? Directory::Stat() : Directory::Stat(fi.name().c_str(), true);
+			const bool identified = (stat.fileType == Directory::Stat::Regular);
+			const FileId id(stat.device, stat.inode);
+
+			auto origin = identified ? readFiles.find(id) : readFiles.end();
+
+			bool ok = true;
+			if(origin != readFiles.end())
+			{
+				fi.share(*origin->second);
+				Stats::add(Stats::FilesShared);
+			}
+			else
+			{
+				ok = options_.cache ? fi.read(*options_.cache) : fi.read();
+				if(ok && identified)
+				{
+					readFiles.emplace(id, &fi);
+				}
+			}
+
+			if(&list == &destination_ && ok)
+			{
+				// add file to digest index
+				destinationDigestIndex_.insert(&fi);
+			}
+
+			fileIndex += 1;
+			progress(fileIndex, total);
+		}
+	}
+}
+
+
+size_t Matcher::findExactMatches()
+{
+	size_t matchesCount = 0;
+
+	if(!options_.all)
+	{
+		// start matching from scratch
+		Edges empty;
+		edges_.swap(empty);
+		sourceExact_.assign(source_.size(), false);
+		destinationExact_.assign(isSelfCompare() ? 0 : destination_.size(), false);
+
+		std::vector<Edges> emptyBest;
+		sourceBest_.swap(emptyBest);
+		destinationBest_.clear();
+	}
+
+	for(size_t srcIndex = 0; srcIndex != source_.size(); ++srcIndex)
+	{
+		auto& src = source_[srcIndex];
+
+		if(!options_.all && sourceExact_[srcIndex])
+		{
+			// skip already matched file
+			continue;
+		}
+
+		auto dstRange = destinationDigestIndex_.equal_range(&src);
+		for(auto dstIt = dstRange.first; dstIt != dstRange.second; ++dstIt)
+		{
+			auto& dst = **dstIt;
+
+			if(src.nameId() == dst.nameId())
+			{
+				// don't compare the file with itself
+				continue;
+			}
+
+			if(options_.all)
+			{
+				match(1.0f, src, dst);
+				matchesCount += 1;
+				continue;
+			}
+
+			const size_t dstIndex = &dst - destination_.data();
+			if(destinationExact()[dstIndex])
+			{
+				// skip already processed file
+				continue;
+			}
+
+			addMatch(srcIndex, dstIndex, 1.0f);
+			sourceExact_[srcIndex] = true;
+			destinationExact()[dstIndex] = true;
+			matchesCount += 1;
+			break;
+		}
+
+		progress(srcIndex + 1, source_.size());
+	}
+
+	return matchesCount;
+}
+
+
+size_t Matcher::findSimilarFiles()
+{
+	std::vector<size_t> sourceIndices;
+	sourceIndices.reserve(source_.size() / options_.shardCount + 1);
+	for(size_t i = options_.shardIndex; i < source_.size(); i += options_.shardCount)
+	{
+		sourceIndices.push_back(i);
+	}
+
+	std::vector<size_t> destinationIndices(destination_.size());
+	for(size_t i = 0; i != destinationIndices.size(); ++i)
+	{
+		destinationIndices[i] = i;
+	}
+
+	return findSimilarFiles(sourceIndices, destinationIndices);
+}
+
+
+size_t Matcher::findSimilarFiles(const std::vector<size_t>& sourceIndices, const std::vector<size_t>& destinationIndices)
+{
+	if(!options_.all && options_.maxMatchesPerFile == 0 && options_.shardCount == 1)
+	{
+		return findBestSimilarFiles(sourceIndices, destinationIndices);
+	}
+
+	const float minSimilarity = options_.minSimilarity;
+	const bool all = options_.all;
+	const bool approx = options_.approx;
+	const bool selfCompare = isSelfCompare();
+
+	// each pair of a list compared with itself is met once
+	const bool symmetric = selfCompare && sourceIndices == destinationIndices;
+
+	// files with the same contents are compared once, results are given to
+	// each of them
+	std::vector<std::vector<size_t>> sources;
+	std::vector<size_t> groupOf(all ? sourceIndices.size() : 0); // by position in sourceIndices
+	for(const auto& group: groupByDigest(source_, sourceIndices))
+	{
+		for(size_t i = 0; all && i != group.size(); ++i)
+		{
+			groupOf[group[i]] = sources.size();
+		}
+
+		sources.push_back(comparableMembers(source_, sourceExact_, sourceIndices, group));
+	}
+
+	std::vector<std::vector<size_t>> destinationsStorage;
+	if(!symmetric)
+	{
+		for(const auto& group: groupByDigest(destination_, destinationIndices))
+		{
+			destinationsStorage.push_back(comparableMembers(destination_, destinationExact(), destinationIndices, group));
+		}
+	}
+
+	const auto& destinations = symmetric ? sources : destinationsStorage;
+	const GroupFields destinationFields = collectFields(destination_, destinations);
+
+	const size_t sourceCount = sources.size();
+	const size_t destinationCount = destinations.size();
+	const float total = symmetric ?
+		static_cast<float>(sourceCount) * (sourceCount - 1) / 2 :
+		static_cast<float>(sourceCount) * destinationCount;
+
+	size_t matchesCount = 0;
+	float progressCurrent = 0.0f;
+
+	// in `all` mode matches of each source are kept until all its groups are
+	// compared, then reported with destinations in list order
+	std::vector<Edges> rows(all ? source_.size() : 0);
+	size_t nextRow = 0; // position in sourceIndices
+
+	auto report = [&](float similarity, size_t srcIndex, size_t dstIndex)
+	{
+		if(all)
+		{
+			rows[srcIndex].emplace_back(similarity, srcIndex, dstIndex);
+			matchesCount += 1;
+
+			if(symmetric)
+			{
+				// the other direction is not compared, it is reported in the
+				// row of its own source
+				rows[dstIndex].emplace_back(similarity, dstIndex, srcIndex);
+				matchesCount += 1;
+			}
+		}
+		else if(symmetric || !selfCompare || srcIndex < dstIndex)
+		{
+			// in asymmetric self comparison each pair is met twice
+			addMatch(srcIndex, dstIndex, similarity);
+			matchesCount += 1;
+		}
+	};
+
+	// pairs are visited in tiles so fingerprints of a tile stay in cache
+	for(size_t srcTile = 0; srcTile < sourceCount; srcTile += TILE_SIZE)
+	{
+		for(size_t dstTile = symmetric ? srcTile : 0; dstTile < destinationCount; dstTile += TILE_SIZE)
+		{
+			for(size_t srcGroup = srcTile; srcGroup != std::min(srcTile + TILE_SIZE, sourceCount); ++srcGroup)
+			{
+				const auto& srcMembers = sources[srcGroup];
+				if(srcMembers.empty())
+				{
+					continue;
+				}
+
+				auto& src = source_[srcMembers.front()];
+				const size_t srcDigest = src.digest().hash();
+				const uint64_t srcSize = src.size();
+
+				src.acquireSpanHash(options_.fingerprint); // extra reference to avoid races inside loop
+
+				const size_t dstBegin = symmetric ? std::max(dstTile, srcGroup + 1) : dstTile;
+				for(size_t dstGroup = dstBegin; dstGroup < std::min(dstTile + TILE_SIZE, destinationCount); ++dstGroup)
+				{
+					const auto& dstMembers = destinations[dstGroup];
+					if(dstMembers.empty())
+					{
+						continue;
+					}
+
+					if(destinationFields.digests[dstGroup] == srcDigest && src.digest() == destination_[dstMembers.front()].digest())
+					{
+						// skip exact matches and the file itself
+						continue;
+					}
+
+					Stats::add(Stats::CandidatePairs);
+
+					if(sizeBound(srcSize, destinationFields.sizes[dstGroup]) < minSimilarity)
+					{
+						// maximum possible similarity is below limit
+						Stats::add(Stats::SizePrunedPairs);
+						continue;
+					}
+
+					auto& dst = destination_[dstMembers.front()];
+
+					src.acquireSpanHash(options_.fingerprint);
+					dst.acquireSpanHash(options_.fingerprint);
+					if(!src.spanHash().isValid() || !dst.spanHash().isValid())
+					{
+						continue;
+					}
+
+					if(src.spanHash().maxSimilarity(dst.spanHash()) * 0.99f < minSimilarity)
+					{
+						// common spans can't reach the limit
+						Stats::add(Stats::SketchPrunedPairs);
+						src.releaseSpanHash();
+						continue;
+					}
+
+					if(approx)
+					{
+						src.buildSample();
+						dst.buildSample();
+					}
+
+					AsyncManager::async(false, [&, srcGroup, dstGroup]
+					{
+						const float similarity = compareSpanHashes(src, dst, !all);
+
+						AsyncManager::sync([&, srcGroup, dstGroup, similarity]
+						{
+							src.releaseSpanHash();
+							// dst.releaseSpanHash(); // don't release dst to avoid its re-read by the next src
+
+							if(similarity >= minSimilarity)
+							{
+								for(size_t srcIndex: sources[srcGroup])
+								{
+									for(size_t dstIndex: destinations[dstGroup])
+									{
+										report(similarity, srcIndex, dstIndex);
+									}
+								}
+							}
+						});
+					});
+
+					AsyncManager::tick();
+				}
+
+				src.releaseSpanHash(); // release extra reference
+			}
+
+			// all pairs of the tile are queued
+			AsyncManager::sync([&, srcTile, dstTile]
+			{
+				const size_t rows = std::min(TILE_SIZE, sourceCount - srcTile);
+				const size_t columns = std::min(TILE_SIZE, destinationCount - dstTile);
+				progressCurrent += (symmetric && srcTile == dstTile) ?
+					static_cast<float>(rows) * (rows - 1) / 2 :
+					static_cast<float>(rows) * columns;
+				progress(progressCurrent, total);
+			});
+		}
+
+		if(all)
+		{
+			// groups of this tile and all before it are compared with every
+			// destination, and with each other in a symmetric comparison
+			AsyncManager::syncAll();
+
+			const size_t groupEnd = std::min(srcTile + TILE_SIZE, sourceCount);
+			for(; nextRow != sourceIndices.size() && groupOf[nextRow] < groupEnd; ++nextRow)
+			{
+				Edges row;
+				row.swap(rows[sourceIndices[nextRow]]);
+				std::sort(row.begin(), row.end(), [](const Edge& lhs, const Edge& rhs)
+				{
+					return lhs.destination < rhs.destination;
+				});
+
+				for(const auto& edge: row)
+				{
+					match(edge.similarity, source_[edge.source], destination_[edge.destination]);
+				}
+			}
+		}
+	}
+
+	AsyncManager::syncAll();
+
+	return matchesCount;
+}
+
+
+size_t Matcher::findBestSimilarFiles(const std::vector<size_t>& sourceIndices, const std::vector<size_t>& destinationIndices)
+{
+	// Greedy matching in dumpMatches() takes a pair if it is better than
+	// all pairs of both its files that are not taken before. Such pair is
+	// locked as soon as it is better than every other pair or bound of its
+	// files, then all other pairs of these files can't be taken and are
+	// never compared.
+
+	const float minSimilarity = options_.minSimilarity;
+	const bool approx = options_.approx;
+	const bool selfCompare = isSelfCompare();
+	const size_t destinationCount = destinationIndices.size();
+	const float total = static_cast<float>(sourceIndices.size()) * destinationCount;
+
+	// 1. load fingerprints of the first file with the same contents,
+	// destinations are kept as in findSimilarFiles()
+
+	std::vector<std::vector<size_t>> sources;
+	for(const auto& group: groupByDigest(source_, sourceIndices))
+	{
+		auto members = comparableMembers(source_, sourceExact_, sourceIndices, group);
+		if(!members.empty())
+		{
+			auto& src = source_[members.front()];
+			src.acquireSpanHash(options_.fingerprint);
+			if(approx)
+			{
+				src.buildSample();
+			}
+
+			sources.push_back(std::move(members));
+		}
+	}
+
+	std::vector<std::vector<size_t>> destinations;
+	for(const auto& group: groupByDigest(destination_, destinationIndices))
+	{
+		auto members = comparableMembers(destination_, destinationExact(), destinationIndices, group);
+		if(!members.empty())
+		{
+			auto& dst = destination_[members.front()];
+			dst.acquireSpanHash(options_.fingerprint);
+			if(approx)
+			{
+				dst.buildSample();
+			}
+
+			if(dst.spanHash().isValid())
+			{
+				destinations.push_back(std::move(members));
+			}
+		}
+	}
+
+	// 2. candidate destinations of each source, most likely ones first
+
+	const GroupFields destinationFields = collectFields(destination_, destinations);
+
+	std::vector<const SpanHash*> destinationSpanHashes;
+	destinationSpanHashes.reserve(destinations.size());
+	for(const auto& members: destinations)
+	{
+		destinationSpanHashes.push_back(&destination_[members.front()].spanHash());
+	}
+
+	std::vector<std::vector<Candidate>> candidates(sources.size());
+	for(size_t srcGroup = 0; srcGroup != sources.size(); ++srcGroup)
+	{
+		if(!source_[sources[srcGroup].front()].spanHash().isValid())
+		{
+			continue;
+		}
+
+		AsyncManager::async([&, srcGroup]
+		{
+			const FileInfo& src = source_[sources[srcGroup].front()];
+			const size_t srcDigest = src.digest().hash();
+			const uint64_t srcSize = src.size();
+			auto& list = candidates[srcGroup];
+
+			// digests and sizes are checked first in a pass over contiguous
+			// fields, only the remaining groups are looked up
+			std::vector<uint32_t> remaining;
+			size_t candidatePairs = 0;
+			for(size_t dstGroup = 0; dstGroup != destinations.size(); ++dstGroup)
+			{
+				if(destinationFields.digests[dstGroup] == srcDigest && src.digest() == destination_[destinations[dstGroup].front()].digest())
+				{
+					// exact match or the file itself
+					continue;
+				}
+
+				candidatePairs += 1;
+
+				if(sizeBound(srcSize, destinationFields.sizes[dstGroup]) >= minSimilarity)
+				{
+					remaining.push_back(dstGroup);
+				}
+			}
+
+			size_t sketchPruned = 0;
+			for(uint32_t dstGroup: remaining)
+			{
+				// size ratio is not a bound for sampled fingerprints, the
+				// sketch is always one
+				const float bound = src.spanHash().maxSimilarity(*destinationSpanHashes[dstGroup]) * 0.99f;
+				if(bound < minSimilarity)
+				{
+					sketchPruned += 1;
+					continue;
+				}
+
+				for(size_t dstIndex: destinations[dstGroup])
+				{
+					list.push_back(Candidate{bound, static_cast<uint32_t>(dstIndex), dstGroup});
+				}
+			}
+
+			Stats::add(Stats::CandidatePairs, candidatePairs);
+			Stats::add(Stats::SizePrunedPairs, candidatePairs - remaining.size());
+			Stats::add(Stats::SketchPrunedPairs, sketchPruned);
+
+			std::sort(list.begin(), list.end(), isMoreLikely);
+		});
+	}
+
+	AsyncManager::syncAll();
+
+	// every pair of a destination is in the list of its source (in self
+	// comparison each pair is in both lists)
+	std::vector<TopBounds> destinationBounds(destination_.size());
+	for(size_t srcGroup = 0; srcGroup != sources.size(); ++srcGroup)
+	{
+		for(size_t srcIndex: sources[srcGroup])
+		{
+			for(const auto& candidate: candidates[srcGroup])
+			{
+				destinationBounds[candidate.destination].offer(candidate.bound, srcIndex);
+			}
+		}
+	}
+
+	// 3. compare sources with their candidates until their pairs are locked
+
+	std::unique_ptr<std::atomic<bool>[]> sourceLockedStorage(new std::atomic<bool>[source_.size()]);
+	std::unique_ptr<std::atomic<bool>[]> destinationLockedStorage(new std::atomic<bool>[selfCompare ? 0 : destination_.size()]);
+	std::atomic<bool>* sourceLocked = sourceLockedStorage.get();
+	std::atomic<bool>* destinationLocked = selfCompare ? sourceLocked : destinationLockedStorage.get();
+	for(size_t i = 0; i != source_.size(); ++i)
+	{
+		sourceLocked[i].store(false);
+	}
+	for(size_t i = 0; !selfCompare && i != destination_.size(); ++i)
+	{
+		destinationLocked[i].store(false);
+	}
+
+	// similarities of group pairs compared so far, shared by all sources so
+	// that in self comparison each pair is compared once
+	std::unordered_map<uint64_t, float> similarities;
+	std::mutex similaritiesMutex;
+
+	auto keyOf = [&](size_t srcGroup, size_t dstGroup)
+	{
+		const size_t srcIndex = sources[srcGroup].front();
+		const size_t dstIndex = destinations[dstGroup].front();
+		return (selfCompare && dstIndex < srcIndex) ?
+			(static_cast<uint64_t>(dstIndex) << 32) | srcIndex :
+			(static_cast<uint64_t>(srcIndex) << 32) | dstIndex;
+	};
+
+	auto similarityOf = [&](size_t srcGroup, size_t dstGroup)
+	{
+		const size_t srcIndex = sources[srcGroup].front();
+		const size_t dstIndex = destinations[dstGroup].front();
+		const uint64_t key = keyOf(srcGroup, dstGroup);
+
+		{
+			std::lock_guard<std::mutex> lock(similaritiesMutex);
+			auto it = similarities.find(key);
+			if(it != similarities.end())
+			{
+				return it->second;
+			}
+		}
+
+		// the pair may be compared by another source meanwhile, the result
+		// is the same
+		const float similarity = compareSpanHashes(source_[srcIndex], destination_[dstIndex], true);
+
+		std::lock_guard<std::mutex> lock(similaritiesMutex);
+		similarities[key] = similarity;
+		return similarity;
+	};
+
+	size_t matchesCount = 0;
+	size_t sourcesDone = 0;
+
+	for(size_t srcGroup = 0; srcGroup != sources.size(); ++srcGroup)
+	{
+		AsyncManager::async(false, [&, srcGroup]
+		{
+			const auto& list = candidates[srcGroup];
+
+			for(size_t srcIndex: sources[srcGroup])
+			{
+				// pairs of the source found so far in the same form addMatch() keeps them
+				Edges found;
+
+				auto makeEdge = [&](float similarity, size_t dstIndex)
+				{
+					return (selfCompare && dstIndex < srcIndex) ?
+						Edge(similarity, dstIndex, srcIndex) :
+						Edge(similarity, srcIndex, dstIndex);
+				};
+
+				auto partnerOf = [&](const Edge& edge)
+				{
+					return (selfCompare && edge.destination == srcIndex) ? edge.source : edge.destination;
+				};
+
+				// lock the best pair whose partner is still free if it is
+				// better than `bound` of the rest of the source pairs
+				auto tryLock = [&](float bound)
+				{
+					const Edge* best = nullptr;
+					for(const auto& edge: found)
+					{
+						if(!destinationLocked[partnerOf(edge)] && (!best || isBetter(edge, *best)))
+						{
+							best = &edge;
+						}
+					}
+
+					if(!best || best->similarity <= bound)
+					{
+						return false;
+					}
+
+					const uint32_t partner = partnerOf(*best);
+					if(best->similarity <= destinationBounds[partner].other(srcIndex))
+					{
+						return false;
+					}
+
+					sourceLocked[srcIndex] = true;
+					destinationLocked[partner] = true;
+					return true;
+				};
+
+				size_t pos = 0;
+				for(; pos != list.size(); ++pos)
+				{
+					const Candidate& candidate = list[pos];
+
+					if(selfCompare && sourceLocked[srcIndex])
+					{
+						// taken by a pair locked by another source
+						break;
+					}
+
+					if(destinationLocked[candidate.destination])
+					{
+						// partner is taken by a better pair
+						continue;
+					}
+
+					if(tryLock(candidate.bound))
+					{
+						break;
+					}
+
+					const size_t dstIndex = candidate.destination;
+					const float similarity = similarityOf(srcGroup, candidate.group);
+					if(similarity < minSimilarity)
+					{
+						continue;
+					}
+
+					found.push_back(makeEdge(similarity, dstIndex));
+
+					// in self comparison each pair may be met twice, it is
+					// counted by its lesser file
+					const bool counted = !selfCompare || srcIndex < dstIndex;
+					AsyncManager::sync([this, srcIndex, dstIndex, similarity, counted, &matchesCount]
+					{
+						addMatch(srcIndex, dstIndex, similarity);
+						matchesCount += counted ? 1 : 0;
+					});
+				}
+
+				if(pos == list.size())
+				{
+					// no pairs left
+					tryLock(-1.0f);
+				}
+			}
+
+			AsyncManager::sync([&, srcGroup]
+			{
+				sourcesDone += sources[srcGroup].size();
+				progress(static_cast<float>(sourcesDone) * destinationCount, total);
+			});
+		});
+
+		AsyncManager::tick();
+	}
+
+	AsyncManager::syncAll();
+
+	// 4. the pairs found hold the best matches, but dumpMatches() also
+	// follows pairs better than the match of either of their files to report
+	// matches in order, and such pairs may have been skipped
+
+	sortEdges();
+
+	std::vector<float> sourceMatch(source_.size(), -1.0f);
+	std::vector<float> destinationMatchStorage(selfCompare ? 0 : destination_.size(), -1.0f);
+	std::vector<float>& destinationMatch = selfCompare ? sourceMatch : destinationMatchStorage;
+	for(const auto& edge: edges_)
+	{
+		if(sourceMatch[edge.source] < 0.0f && destinationMatch[edge.destination] < 0.0f)
+		{
+			sourceMatch[edge.source] = edge.similarity;
+			destinationMatch[edge.destination] = edge.similarity;
+		}
+	}
+
+	for(size_t srcGroup = 0; srcGroup != sources.size(); ++srcGroup)
+	{
+		AsyncManager::async(false, [&, srcGroup]
+		{
+			size_t pruned = 0;
+			for(size_t srcIndex: sources[srcGroup])
+			{
+				for(const auto& candidate: candidates[srcGroup])
+				{
+					const size_t dstIndex = candidate.destination;
+					if(selfCompare && dstIndex < srcIndex)
+					{
+						// the pair is in the list of the lesser file too
+						continue;
+					}
+
+					if(candidate.bound < std::min(sourceMatch[srcIndex], destinationMatch[dstIndex]))
+					{
+						std::lock_guard<std::mutex> lock(similaritiesMutex);
+						pruned += similarities.count(keyOf(srcGroup, candidate.group)) == 0 ? 1 : 0;
+						continue;
+					}
+
+					const float similarity = similarityOf(srcGroup, candidate.group);
+					if(similarity >= minSimilarity)
+					{
+						AsyncManager::sync([this, srcIndex, dstIndex, similarity]
+						{
+							addMatch(srcIndex, dstIndex, similarity);
+						});
+					}
+				}
+			}
+
+			Stats::add(Stats::BoundPrunedPairs, pruned);
+		});
+
+		AsyncManager::tick();
+	}
+
+	AsyncManager::syncAll();
+
+	for(const auto& members: sources)
+	{
+		source_[members.front()].releaseSpanHash();
+	}
+
+	return matchesCount;
+}
+
+
+std::vector<size_t> Matcher::comparableMembers(const FileList& list, const std::vector<bool>& exact, const std::vector<size_t>& indices, const std::vector<size_t>& group) const
+{
+	std::vector<size_t> result;
+	for(size_t pos: group)
+	{
+		const size_t index = indices[pos];
+		if(options_.textOnly && list[index].isBinary())
+		{
+			// skip binaries
+			continue;
+		}
+
+		if(!options_.all && hasExactMatch(exact, index))
+		{
+			// skip files with exact match
+			continue;
+		}
+
+		result.push_back(index);
+	}
+
+	return result;
+}
+
+
+float Matcher::compareSpanHashes(const FileInfo& src, const FileInfo& dst, bool contending) const
+{
+	float similarity = 0.0f;
+	bool exact = true;
+
+	{
+		TRACE_SCOPE("compare");
+		Stats::Timer timer(Stats::CompareTime);
+
+		if(options_.approx && src.sample().isValid() && dst.sample().isValid())
+		{
+			// only estimates close to the limit or of pairs ranked against
+			// each other need the exact value
+			similarity = src.sample().compare(dst.sample()) * 0.99f;
+			exact =
+				similarity >= options_.minSimilarity - options_.approxMargin &&
+				(contending || similarity < options_.minSimilarity + options_.approxMargin);
+		}
+
+		if(exact)
+		{
+			// exact matches were found before so these files can't be exactly the same
+			similarity = src.spanHash().compare(dst.spanHash()) * 0.99f;
+		}
+	}
+
+	if(exact)
+	{
+		Stats::add(Stats::CompareCalls);
+		Stats::add(Stats::CompareWork, src.spanHash().entryCount());
+	}
+	else if(similarity < options_.minSimilarity)
+	{
+		// estimate is too far below the limit
+		Stats::add(Stats::ApproxPrunedPairs);
+	}
+	else
+	{
+		// estimate is far enough above the limit
+		Stats::add(Stats::ApproxAcceptedPairs);
+	}
+
+	return similarity;
+}
+
+
+void Matcher::addMatch(size_t sourceIndex, size_t destinationIndex, float similarity)
+{
+	if(isSelfCompare() && destinationIndex < sourceIndex)
+	{
+		std::swap(sourceIndex, destinationIndex);
+	}
+
+	const Edge edge(similarity, sourceIndex, destinationIndex);
+	edges_.push_back(edge);
+
+	const size_t limit = options_.maxMatchesPerFile;
+	if(limit == 0)
+	{
+		return;
+	}
+
+	if(sourceBest_.empty())
+	{
+		sourceBest_.resize(source_.size());
+		destinationBest_.resize(isSelfCompare() ? 0 : destination_.size());
+	}
+
+	offer(sourceBest_[sourceIndex], edge, limit);
+	offer(destinationBest()[destinationIndex], edge, limit);
+
+	if(edges_.size() > PRUNE_FACTOR * limit * (source_.size() + destination_.size()))
+	{
+		pruneEdges();
+	}
+}
+
+
+Matcher::Edges Matcher::similarPairs() const
+{
+	Edges result;
+
+	if(options_.maxMatchesPerFile == 0)
+	{
+		result = edges_;
+	}
+	else
+	{
+		// pairs out of the best ones of both files may still be needed to
+		// rank pairs found by other shards
+		for(const auto& best: sourceBest_)
+		{
+			result.insert(result.end(), best.begin(), best.end());
+		}
+
+		for(const auto& best: destinationBest_)
+		{
+			result.insert(result.end(), best.begin(), best.end());
+		}
+
+		std::sort(result.begin(), result.end(), isBetter);
+		result.erase(std::unique(result.begin(), result.end(), [](const Edge& lhs, const Edge& rhs)
+		{
+			return lhs.source == rhs.source && lhs.destination == rhs.destination;
+		}), result.end());
+	}
+
+	// exact matches are found by each matcher itself
+	result.erase(std::remove_if(result.begin(), result.end(), [](const Edge& edge)
+	{
+		return edge.similarity >= 1.0f;
+	}), result.end());
+
+	return result;
+}
+
+
+size_t Matcher::dumpMatches()
+{
+	if(options_.maxMatchesPerFile != 0)
+	{
+		pruneEdges();
+	}
+
+	sortEdges();
+
+	// the same pair may be added more than once
+	edges_.erase(std::unique(edges_.begin(), edges_.end(), [](const Edge& lhs, const Edge& rhs)
+	{
+		return lhs.source == rhs.source && lhs.destination == rhs.destination;
+	}), edges_.end());
+
+	const bool selfCompare = isSelfCompare();
+	const PairLists sourcePairs(edges_, source_.size(), selfCompare, true);
+	PairLists destinationPairsStorage;
+	if(!selfCompare)
+	{
+		destinationPairsStorage = PairLists(edges_, destination_.size(), false, false);
+	}
+
+	const PairLists& destinationPairs = selfCompare ? sourcePairs : destinationPairsStorage;
+
+	std::vector<bool> sourceTaken(source_.size(), false);
+	std::vector<bool> destinationTakenStorage(selfCompare ? 0 : destination_.size(), false);
+	std::vector<bool>& destinationTaken = selfCompare ? sourceTaken : destinationTakenStorage;
+
+	std::vector<size_t> sourceNext(source_.size(), 0);
+	std::vector<size_t> destinationNextStorage(selfCompare ? 0 : destination_.size(), 0);
+	std::vector<size_t>& destinationNext = selfCompare ? sourceNext : destinationNextStorage;
+
+	// best pair of a file whose other file is still free
+	auto best = [this](const PairLists& pairs, std::vector<size_t>& next, const std::vector<bool>& otherTaken, size_t file) -> const Edge*
+	{
+		for(size_t& pos = next[file]; pos != pairs.size(file); ++pos)
+		{
+			const Edge& edge = edges_[pairs.at(file, pos)];
+			if(!otherTaken[pairs.other(edge, file)])
+			{
+				return &edge;
+			}
+		}
+
+		return nullptr;
+	};
+
+	// Follow best pairs from each source until a pair is the best one of both
+	// its files: that pair is taken and reported from the file reached on the
+	// source side. Pairs of each step are better than the previous ones, and
+	// the pairs taken are the same as taking the best free pairs greedily.
+	size_t matchesCount = 0;
+	for(size_t srcIndex = 0; srcIndex != source_.size(); ++srcIndex)
+	{
+		while(!sourceTaken[srcIndex])
+		{
+			const Edge* edge = best(sourcePairs, sourceNext, destinationTaken, srcIndex);
+			if(!edge)
+			{
+				break;
+			}
+
+			size_t src = srcIndex;
+			while(true)
+			{
+				const size_t dst = sourcePairs.other(*edge, src);
+				const Edge* back = best(destinationPairs, destinationNext, sourceTaken, dst);
+				if(back == edge)
+				{
+					sourceTaken[src] = true;
+					destinationTaken[dst] = true;
+					match(edge->similarity, source_[src], destination_[dst]);
+					matchesCount += 1;
+					break;
+				}
+
+				src = destinationPairs.other(*back, dst);
+				edge = best(sourcePairs, sourceNext, destinationTaken, src);
+			}
+		}
+
+		progress(srcIndex + 1, source_.size());
+	}
+
+	Edges empty;
+	edges_.swap(empty);
+
+	return matchesCount;
+}
+
+
+void Matcher::run()
+{
+	hash();
+	findExactMatches();
+
+	if(!isExactOnly())
+	{
+		findSimilarFiles();
+	}
+
+	if(!options_.all)
+	{
+		dumpMatches();
+	}
+}
+
+
+float Matcher::compare(FileInfo& source, FileInfo& destination, const SpanHash::Options& options)
+{
+	if(source.digest() == destination.digest())
+	{
+		return 1.0f;
+	}
+
+	source.acquireSpanHash(options);
+	destination.acquireSpanHash(options);
+
+	float similarity = 0.0f;
+	if(source.spanHash().isValid() && destination.spanHash().isValid())
+	{
+		// files differ so similarity is kept below 1
+		similarity = source.spanHash().compare(destination.spanHash()) * 0.99f;
+	}
+
+	source.releaseSpanHash();
+	destination.releaseSpanHash();
+
+	return similarity;
+}
+
+
+void Matcher::sortEdges()
+{
+	auto order = isBetter;
+
+	const size_t workers = std::max<size_t>(1, std::thread::hardware_concurrency());
+	const size_t chunkSize = std::max(MIN_SORT_CHUNK, (edges_.size() + workers - 1) / workers);
+
+	std::vector<size_t> bounds;
+	for(size_t begin = 0; begin < edges_.size(); begin += chunkSize)
+	{
+		bounds.push_back(begin);
+	}
+	bounds.push_back(edges_.size());
+
+	const size_t chunkCount = bounds.size() - 1;
+	const auto begin = edges_.begin();
+
+	// sort chunks in parallel
+	for(size_t i = 0; i < chunkCount; ++i)
+	{
+		const size_t first = bounds[i];
+		const size_t last = bounds[i + 1];
+		AsyncManager::async("sort", [begin, first, last, &order]
+		{
+			std::sort(begin + first, begin + last, order);
+		});
+	}
+
+	AsyncManager::sync("sort");
+
+	// then merge them pairwise, merges of the same level run in parallel
+	for(size_t width = 1; width < chunkCount; width *= 2)
+	{
+		for(size_t i = 0; i + width < chunkCount; i += 2 * width)
+		{
+			const size_t first = bounds[i];
+			const size_t middle = bounds[i + width];
+			const size_t last = bounds[std::min(i + 2 * width, chunkCount)];
+			AsyncManager::async("sort", [begin, first, middle, last, &order]
+			{
+				std::inplace_merge(begin + first, begin + middle, begin + last, order);
+			});
+		}
+
+		AsyncManager::sync("sort");
+	}
+}
+
+
+void Matcher::pruneEdges()
+{
+	// a pair that dropped out of the best ones of a file never gets back
+	edges_.erase(std::remove_if(edges_.begin(), edges_.end(), [this](const Edge& edge)
+	{
+		return !isBest(edge);
+	}), edges_.end());
+}
+
+
+bool Matcher::isBest(const Edge& edge) const
+{
+	const size_t limit = options_.maxMatchesPerFile;
+
+	const Edges& sourceHeap = sourceBest_[edge.source];
+	const Edges& destinationHeap = destinationBest()[edge.destination];
+
+	// every pair was offered to both heaps, so it is there unless it is worse
+	// than the worst one kept
+	return
+		(sourceHeap.size() < limit || !isBetter(sourceHeap.front(), edge)) &&
+		(destinationHeap.size() < limit || !isBetter(destinationHeap.front(), edge));
+}
+
+
+void Matcher::progress(float current, float total) const
+{
+	if(progressCallback_)
+	{
+		progressCallback_(current, total);
+	}
+}
+
+
+void Matcher::match(float similarity, const FileInfo& source, const FileInfo& destination) const
+{
+	if(matchCallback_)
+	{
+		matchCallback_(similarity, source, destination);
+	}
+}
@@ -0,0 +1,259 @@
+#ifndef MATCHER_HPP_INCLUDED
+#define MATCHER_HPP_INCLUDED
+
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+
+#include <functional>
+#include <vector>
+
+#include "file_info.hpp"
+
+
+class FingerprintCache;
+
+
+/**
+Similarity search over in-memory sets of files.
+
+Typical usage runs steps in order:
+1. hash() - calculate file digests;
+2. findExactMatches() - pair files with the same digest;
+3. findSimilarFiles() - compare fingerprints of remaining files;
+4. dumpMatches() - report the best one to one matches.
+
+Best matches are the pairs taken greedily from the list of all similar pairs
+sorted by similarity: a pair is taken if neither of its files was taken before.
+
+In `all` mode matches are reported as soon as they are found and
+dumpMatches() reports nothing.
+*/
+class Matcher
+{
+public:
+	struct Options
+	{
+		Options():
+			minSimilarity(0.5f),
+			all(false),
+			textOnly(false),
+			maxMatchesPerFile(0),
+			approx(false),
+			approxMargin(0.2f),
+			shardIndex(0),
+			shardCount(1),
+			fingerprint(),
+			cache(nullptr)
+		{
+		}
+
+		float minSimilarity;
+		bool all;
+		bool textOnly;
+
+		/**
+		Number of best similar pairs each file keeps while searching for the
+		best one to one matches, 0 means no limit. A pair is dropped unless it
+		is among the best ones of both its files (of all pairs found).
+		*/
+		size_t maxMatchesPerFile;
+
+		/**
+		Estimate similarity from sampled fingerprints first and compare the
+		full ones only if the estimate is within `approxMargin` of
+		`minSimilarity`. Pairs estimated further below are dropped. Pairs
+		estimated further above keep the estimate in `all` mode. Best matches
+		are ranked by exact similarities.
+		*/
+		bool approx;
+		float approxMargin;
+
+		/**
+		findSimilarFiles() compares only sources at list positions
+		`shardIndex`, `shardIndex + shardCount`, ... with all destinations.
+		*/
+		size_t shardIndex;
+		size_t shardCount;
+
+		/**
+		Settings of fingerprints built by the matcher. The cache and index
+		files given as sources or destinations must use the same ones.
+		*/
+		SpanHash::Options fingerprint;
+
+		/**
+		Optional cache of file fingerprints used by hash().
+		*/
+		FingerprintCache* cache;
+	};
+
+	/**
+	Similar pair of files given by their positions in the lists. In self
+	comparison source position is always the lower one.
+	*/
+	struct Edge
+	{
+		Edge(float similarity, uint32_t source, uint32_t destination):
+			similarity(similarity),
+			source(source),
+			destination(destination)
+		{
+		}
+
+		float similarity;
+		uint32_t source;
+		uint32_t destination;
+	};
+
+	typedef std::vector<Edge> Edges;
+
+	typedef std::function<void(float current, float total)> ProgressCallback;
+	typedef std::function<void(float similarity, const FileInfo& source, const FileInfo& destination)> MatchCallback;
+
+	/**
+	`destination` may refer to the same list as `source`, in this case files
+	of the list are compared with each other.
+	Both lists must outlive the matcher.
+	*/
+	Matcher(FileList& source, FileList& destination, const Options& options);
+
+	const Options& options() const
+	{
+		return options_;
+	}
+
+	void setOptions(const Options& v);
+
+	bool isExactOnly() const
+	{
+		return options_.minSimilarity >= 1.0f;
+	}
+
+	void setProgressCallback(const ProgressCallback& v);
+	void setMatchCallback(const MatchCallback& v);
+
+	/**
+	Read files and build destination digest index.
+	*/
+	void hash();
+
+	/**
+	Returns number of exact matches found.
+	*/
+	size_t findExactMatches();
+
+	/**
+	Returns number of similar file pairs found.
+	*/
+	size_t findSimilarFiles();
+
+	/**
+	Same as above but compare only given sources with given destinations.
+	*/
+	size_t findSimilarFiles(const std::vector<size_t>& sourceIndices, const std::vector<size_t>& destinationIndices);
+
+	/**
+	Add similar pair of files given by their positions in the lists, to be
+	taken into account by dumpMatches().
+	*/
+	void addMatch(size_t sourceIndex, size_t destinationIndex, float similarity);
+
+	/**
+	Similar (not exact) pairs found so far which are needed to choose best
+	matches when they are added with addMatch() to another matcher over the
+	same lists together with pairs found by other shards.
+	*/
+	Edges similarPairs() const;
+
+	/**
+	Report best matches. Returns number of reported matches.
+	*/
+	size_t dumpMatches();
+
+	/**
+	Run all steps.
+	*/
+	void run();
+
+	/**
+	Similarity of two read files using the same rules as findSimilarFiles():
+	exactly equal files have similarity 1, otherwise similarity is below 1.
+	Fingerprints are built with the given settings.
+	*/
+	static float compare(FileInfo& source, FileInfo& destination, const SpanHash::Options& options = SpanHash::Options());
+
+private:
+	FileList& source_;
+	FileList& destination_;
+	Options options_;
+	ProgressCallback progressCallback_;
+	MatchCallback matchCallback_;
+	DigestIndex destinationDigestIndex_;
+	Edges edges_;
+	std::vector<bool> sourceExact_;
+	std::vector<bool> destinationExact_;
+	// best pairs of each file with the worst one on top, only kept if the
+	// number of matches per file is limited
+	std::vector<Edges> sourceBest_;
+	std::vector<Edges> destinationBest_;
+
+	bool isSelfCompare() const
+	{
+		return &source_ == &destination_;
+	}
+
+	bool hasExactMatch(const std::vector<bool>& exact, size_t index) const
+	{
+		return index < exact.size() && exact[index];
+	}
+
+	std::vector<bool>& destinationExact()
+	{
+		return isSelfCompare() ? sourceExact_ : destinationExact_;
+	}
+
+	std::vector<Edges>& destinationBest()
+	{
+		return isSelfCompare() ? sourceBest_ : destinationBest_;
+	}
+
+	const std::vector<Edges>& destinationBest() const
+	{
+		return isSelfCompare() ? sourceBest_ : destinationBest_;
+	}
+
+	/**
+	findSimilarFiles() for best matches without limits: destinations of
+	each source are compared in decreasing order of their similarity
+	bounds until the best pair is known to be taken by dumpMatches().
+	*/
+	size_t findBestSimilarFiles(const std::vector<size_t>& sourceIndices, const std::vector<size_t>& destinationIndices);
+
+	/**
+	Files of `group` (positions in `indices`) that take part in similarity
+	search: not binary if only text is compared and without exact match
+	unless all pairs are reported.
+	*/
+	std::vector<size_t> comparableMembers(const FileList& list, const std::vector<bool>& exact, const std::vector<size_t>& indices, const std::vector<size_t>& group) const;
+
+	/**
+	Similarity of files with acquired fingerprints, estimated first with
+	Options::approx. The estimate is returned if it is too far below the
+	limit, or too far above it and the pair isn't `contending` for a best
+	match.
+	*/
+	float compareSpanHashes(const FileInfo& src, const FileInfo& dst, bool contending) const;
+
+	bool isBest(const Edge& edge) const;
+
+	void sortEdges();
+	void pruneEdges();
+
+	void progress(float current, float total) const;
+	void match(float similarity, const FileInfo& source, const FileInfo& destination) const;
+
+};
+
+
+#endif
@@ -0,0 +1,201 @@
+#include "path_store.hpp"
+#include "stats.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+
+namespace
+{
+
+	// parent of first components of paths and empty slot of the table
+	const PathStore::Id NO_NODE = UINT32_MAX;
+
+	const size_t MIN_TABLE_SIZE = 1024;
+
+	struct Node
+	{
+		PathStore::Id parent;
+		uint32_t name; // offset of NUL terminated component in s_names
+	};
+
+	std::mutex s_mutex;
+	std::vector<Node> s_nodes;
+	std::vector<char> s_names;
+
+	// ids of nodes by their parent and name, open addressing with linear
+	// probing, at most half full
+	std::vector<PathStore::Id> s_table;
+
+	// files are mostly added directory by directory, so the directory of the
+	// previous path is looked up once
+	std::string s_lastDirectory;
+	PathStore::Id s_lastDirectoryId = NO_NODE;
+
+	size_t s_reportedMemory = 0;
+
+	size_t hashOf(PathStore::Id parent, const char* name, size_t length)
+	{
+		// FNV-1a
+		uint64_t result = 14695981039346656037ull ^ parent;
+		for(size_t i = 0; i != length; ++i)
+		{
+			result = (result ^ static_cast<unsigned char>(name[i])) * 1099511628211ull;
+		}
+
+		return result;
+	}
+
+	void grow()
+	{
+		std::vector<PathStore::Id> table(std::max(s_table.size() * 2, MIN_TABLE_SIZE), NO_NODE);
+		const size_t mask = table.size() - 1;
+
+		for(PathStore::Id id = 0; id != s_nodes.size(); ++id)
+		{
+			const char* name = &s_names[s_nodes[id].name];
+			size_t slot = hashOf(s_nodes[id].parent, name, strlen(name)) & mask;
+			while(table[slot] != NO_NODE)
+			{
+				slot = (slot + 1) & mask;
+			}
+
+			table[slot] = id;
+		}
+
+		s_table.swap(table);
+	}
+
+	PathStore::Id child(PathStore::Id parent, const char* name, size_t length)
+	{
+		if((s_nodes.size() + 1) * 2 > s_table.size())
+		{
+			grow();
+		}
+
+		const size_t mask = s_table.size() - 1;
+		size_t slot = hashOf(parent, name, length) & mask;
+		for(; s_table[slot] != NO_NODE; slot = (slot + 1) & mask)
+		{
+			const Node& node = s_nodes[s_table[slot]];
+			if(node.parent == parent && strncmp(&s_names[node.name], name, length) == 0 && s_names[node.name + length] == '\0')
+			{
+				return s_table[slot];
+			}
+		}
+
+		if(s_nodes.size() >= NO_NODE || s_names.size() + length + 1 > UINT32_MAX)
+		{
+			throw std::length_error("too many file paths");
+		}
+
+		Node node;
+		node.parent = parent;
+		node.name = s_names.size();
+		s_names.insert(s_names.end(), name, name + length);
+		s_names.push_back('\0');
+
+		s_table[slot] = s_nodes.size();
+		s_nodes.push_back(node);
+
+		return s_table[slot];
+	}
+
+	void reportMemory()
+	{
+		const size_t memory =
+			s_nodes.capacity() * sizeof(Node) +
+			s_names.capacity() +
+			s_table.capacity() * sizeof(PathStore::Id) +
+			s_lastDirectory.capacity();
+
+		if(memory != s_reportedMemory)
+		{
+			Stats::adjust(Stats::PathMemory, static_cast<int64_t>(memory) - static_cast<int64_t>(s_reportedMemory));
+			s_reportedMemory = memory;
+		}
+	}
+
+}
+
+
+namespace PathStore
+{
+
+	Id add(const std::string& path)
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+
+		Id parent = NO_NODE;
+		size_t begin = 0;
+
+		const size_t slash = path.rfind('/');
+		if(slash != std::string::npos)
+		{
+			if(s_lastDirectoryId != NO_NODE && slash == s_lastDirectory.size() && path.compare(0, slash, s_lastDirectory) == 0)
+			{
+				parent = s_lastDirectoryId;
+			}
+			else
+			{
+				for(size_t end = path.find('/'); ; end = path.find('/', begin))
+				{
+					parent = child(parent, path.data() + begin, end - begin);
+					begin = end + 1;
+
+					if(end == slash)
+					{
+						break;
+					}
+				}
+
+				s_lastDirectory.assign(path, 0, slash);
+				s_lastDirectoryId = parent;
+			}
+
+			begin = slash + 1;
+		}
+
+		const Id result = child(parent, path.data() + begin, path.size() - begin);
+
+		reportMemory();
+
+		return result;
+	}
+
+
+	std::string path(Id id)
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+
+		size_t size = 0;
+		for(Id node = id; node != NO_NODE; node = s_nodes[node].parent)
+		{
+			size += strlen(&s_names[s_nodes[node].name]) + 1; // with separator
+		}
+
+		// components are copied from the last one
+		std::string result(size - 1, '/');
+		size_t end = result.size();
+		for(Id node = id; node != NO_NODE; node = s_nodes[node].parent)
+		{
+			const char* name = &s_names[s_nodes[node].name];
+			const size_t length = strlen(name);
+
+			end -= length;
+			result.replace(end, length, name, length);
+
+			if(end != 0)
+			{
+				end -= 1; // skip separator
+			}
+		}
+
+		return result;
+	}
+
+}
@@ -0,0 +1,40 @@
+#ifndef PATH_STORE_HPP_INCLUDED
+#define PATH_STORE_HPP_INCLUDED
+
+
+#include <stdint.h>
+
+#include <string>
+
+
+/**
+Interned file paths shared by all file lists.
+
+Paths are kept as a tree of their components separated by '/': a path is
+its parent directory node and its last component, so files of the same
+directory share everything but their names and a file takes a few bytes
+plus its name. Equal paths always get the same id. Paths are rebuilt only
+when asked for, nodes are never freed. Memory use is tracked by the
+Stats::PathMemory gauge.
+
+All functions are thread safe.
+*/
+namespace PathStore
+{
+
+	typedef uint32_t Id;
+
+	/**
+	Id of the given path, the path is added if it is new.
+	*/
+	Id add(const std::string& path);
+
+	/**
+	Rebuild the path with the given id.
+	*/
+	std::string path(Id id);
+
+}
+
+
+#endif
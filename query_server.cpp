@@ -0,0 +1,481 @@
+#include "query_server.hpp"
+#include "directory.hpp"
+#include "fingerprint.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+
+namespace
+{
+
+	const size_t READ_CHUNK = 64 * 1024;
+
+	// further clients wait in the listen backlog
+	const size_t MAX_CONNECTIONS = 64;
+
+	/**
+	Thread serving one connection, joined once it has finished.
+	*/
+	struct Connection
+	{
+		Connection():
+			finished(false),
+			thread()
+		{
+		}
+
+		std::atomic<bool> finished;
+		std::thread thread;
+	};
+
+	// best results first, ties are resolved by position in the file list
+	bool isBetter(const QueryServer::Result& lhs, const QueryServer::Result& rhs)
+	{
+		if(lhs.similarity != rhs.similarity)
+		{
+			return lhs.similarity > rhs.similarity;
+		}
+
+		return lhs.fileInfo < rhs.fileInfo;
+	}
+
+	bool sendAll(int fd, const std::string& data)
+	{
+		for(size_t done = 0; done != data.size(); )
+		{
+			ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+			if(n < 0)
+			{
+				if(errno == EINTR)
+				{
+					continue;
+				}
+
+				return false;
+			}
+
+			done += n;
+		}
+
+		return true;
+	}
+
+	bool readLine(FILE* in, std::string& line)
+	{
+		line.clear();
+
+		for(int c = fgetc(in); c != EOF; c = fgetc(in))
+		{
+			if(c == '\n')
+			{
+				return true;
+			}
+
+			line += static_cast<char>(c);
+		}
+
+		return !line.empty();
+	}
+
+	/**
+	Parse `<command> <count> <argument>` request line.
+	*/
+	bool parseRequest(const std::string& line, std::string& command, size_t& count, std::string& argument)
+	{
+		std::istringstream ss(line);
+		if(!(ss >> command >> count) || ss.get() != ' ')
+		{
+			return false;
+		}
+
+		std::getline(ss, argument);
+		return !argument.empty();
+	}
+
+}
+
+
+QueryServer::QueryServer(FileList& files, const Matcher::Options& options):
+	files_(files),
+	options_(options),
+	digestIndex_(),
+	socketPath_(),
+	fd_(-1)
+{
+}
+
+
+QueryServer::~QueryServer()
+{
+	if(fd_ >= 0)
+	{
+		close(fd_);
+		unlink(socketPath_.c_str());
+	}
+}
+
+
+void QueryServer::load()
+{
+	digestIndex_.clear();
+	digestIndex_.reserve(files_.size());
+
+	for(auto& fi: files_)
+	{
+		if(!(options_.cache ? fi.read(*options_.cache) : fi.read()))
+		{
+			continue;
+		}
+
+		digestIndex_.insert(&fi);
+
+		if(!options_.textOnly || !fi.isBinary())
+		{
+			// keep fingerprint for the whole server life time
+			fi.acquireSpanHash(options_.fingerprint);
+		}
+	}
+}
+
+
+QueryServer::Results QueryServer::query(const FileInfo& file, size_t count) const
+{
+	TRACE_SCOPE("query");
+
+	Results results;
+	if(count == 0)
+	{
+		return results;
+	}
+
+	// exact matches go first
+	auto range = digestIndex_.equal_range(const_cast<FileInfo*>(&file));
+	for(auto it = range.first; it != range.second; ++it)
+	{
+		results.emplace_back(1.0f, *it);
+	}
+
+	std::sort(results.begin(), results.end(), isBetter);
+
+	if(results.size() >= count)
+	{
+		results.erase(results.begin() + count, results.end());
+		return results;
+	}
+
+	const float minSimilarity = options_.minSimilarity;
+	if(minSimilarity >= 1.0f || (options_.textOnly && file.isBinary()) || !file.spanHash().isValid())
+	{
+		return results;
+	}
+
+	// the worst of the best results found so far is on top
+	std::priority_queue<Result, std::vector<Result>, bool(*)(const Result&, const Result&)> best(isBetter);
+	const size_t limit = count - results.size();
+
+	for(const auto& dst: files_)
+	{
+		if(options_.textOnly && dst.isBinary())
+		{
+			continue;
+		}
+
+		if(file.digest() == dst.digest())
+		{
+			// already reported as exact match
+			continue;
+		}
+
+		Stats::add(Stats::CandidatePairs);
+
+		// check file sizes
+		const size_t minSize = std::min(file.size(), dst.size());
+		const size_t maxSize = std::max(file.size(), dst.size());
+		const float maxSimilarity = static_cast<float>(minSize) / maxSize * 2.0f; // take LF & CRLF equivalence into account
+		if(maxSimilarity < minSimilarity)
+		{
+			Stats::add(Stats::SizePrunedPairs);
+			continue;
+		}
+
+		if(!dst.spanHash().isValid())
+		{
+			continue;
+		}
+
+		if(file.spanHash().maxSimilarity(dst.spanHash()) * 0.99f < minSimilarity)
+		{
+			Stats::add(Stats::SketchPrunedPairs);
+			continue;
+		}
+
+		float similarity;
+		{
+			Stats::Timer timer(Stats::CompareTime);
+			similarity = file.spanHash().compare(dst.spanHash()) * 0.99f;
+		}
+
+		Stats::add(Stats::CompareCalls);
+		Stats::add(Stats::CompareWork, file.spanHash().entryCount());
+
+		if(similarity < minSimilarity)
+		{
+			continue;
+		}
+
+		const Result result(similarity, &dst);
+		if(best.size() < limit)
+		{
+			best.push(result);
+		}
+		else if(isBetter(result, best.top()))
+		{
+			best.pop();
+			best.push(result);
+		}
+	}
+
+	const size_t exactCount = results.size();
+	for(; !best.empty(); best.pop())
+	{
+		results.push_back(best.top());
+	}
+
+	std::reverse(results.begin() + exactCount, results.end());
+
+	return results;
+}
+
+
+bool QueryServer::listen(const std::string& socketPath)
+{
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	if(socketPath.size() >= sizeof(address.sun_path))
+	{
+		std::cerr << "ERROR: socket path is too long: '" << socketPath << "'" << std::endl;
+		return false;
+	}
+
+	memcpy(address.sun_path, socketPath.c_str(), socketPath.size());
+
+	fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd_ < 0)
+	{
+		std::cerr << "ERROR: failed to create socket" << std::endl;
+		return false;
+	}
+
+	unlink(socketPath.c_str());
+
+	if(bind(fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0 || ::listen(fd_, SOMAXCONN) < 0)
+	{
+		std::cerr << "ERROR: failed to listen on socket: '" << socketPath << "'" << std::endl;
+		close(fd_);
+		fd_ = -1;
+		return false;
+	}
+
+	socketPath_ = socketPath;
+
+	return true;
+}
+
+
+void QueryServer::run()
+{
+	// a connection lives as long as its client keeps it open, so it can't
+	// hold a worker of the pool
+	std::list<Connection> connections;
+	size_t active = 0;
+	std::mutex activeMutex;
+	std::condition_variable activeChanged;
+
+	while(fd_ >= 0)
+	{
+		{
+			std::unique_lock<std::mutex> lock(activeMutex);
+			activeChanged.wait(lock, [&]
+			{
+				return active < MAX_CONNECTIONS;
+			});
+		}
+
+		int fd = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+		if(fd < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+
+			std::cerr << "ERROR: failed to accept connection" << std::endl;
+			break;
+		}
+
+		for(auto it = connections.begin(); it != connections.end(); )
+		{
+			if(it->finished)
+			{
+				it->thread.join();
+				it = connections.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(activeMutex);
+			active += 1;
+		}
+
+		connections.emplace_back();
+		Connection& connection = connections.back();
+		connection.thread = std::thread([this, fd, &connection, &active, &activeMutex, &activeChanged]
+		{
+			TRACE_THREAD_NAME("connection");
+
+			serve(fd);
+			connection.finished = true;
+
+			std::lock_guard<std::mutex> lock(activeMutex);
+			active -= 1;
+			activeChanged.notify_one();
+		});
+	}
+
+	for(auto& connection: connections)
+	{
+		connection.thread.join();
+	}
+}
+
+
+void QueryServer::serve(int fd) const
+{
+	TRACE_SCOPE("connection");
+
+	FILE* in = fdopen(fd, "rb");
+	if(!in)
+	{
+		close(fd);
+		return;
+	}
+
+	std::string line;
+	while(readLine(in, line))
+	{
+		std::string command;
+		size_t count = 0;
+		std::string argument;
+		if(!parseRequest(line, command, count, argument))
+		{
+			sendAll(fd, "ERROR: invalid request\n\n");
+			break;
+		}
+
+		Fingerprint fingerprint(options_.fingerprint);
+		std::string error;
+
+		if(command == "PATH")
+		{
+			const Directory::Stat stat(argument.c_str(), true);
+			if(stat.fileType != Directory::Stat::Regular)
+			{
+				error = "not a regular file: '" + argument + "'";
+			}
+			else if(!fingerprint.ingest(argument.c_str()))
+			{
+				error = "failed to read file: '" + argument + "'";
+			}
+		}
+		else if(command == "DATA")
+		{
+			size_t size = 0;
+			std::istringstream ss(argument);
+			if(!(ss >> size) || !ss.eof())
+			{
+				sendAll(fd, "ERROR: invalid data size\n\n");
+				break;
+			}
+
+			std::vector<char> buffer(READ_CHUNK);
+			while(size != 0)
+			{
+				const size_t n = fread(buffer.data(), 1, std::min(size, buffer.size()), in);
+				if(n == 0)
+				{
+					break;
+				}
+
+				fingerprint.update(buffer.data(), n);
+				size -= n;
+			}
+
+			if(size != 0)
+			{
+				// connection is broken
+				break;
+			}
+		}
+		else
+		{
+			sendAll(fd, "ERROR: unknown command: '" + command + "'\n\n");
+			break;
+		}
+
+		std::ostringstream response;
+
+		if(error.empty())
+		{
+			// the file is already read, its path would only be interned for
+			// the server life time
+			FileInfo file("-", fingerprint.offset());
+			file.read(fingerprint);
+			file.acquireSpanHash(options_.fingerprint);
+
+			for(const auto& result: query(file, count))
+			{
+				response << result.similarity << "|" << result.fileInfo->name() << "\n";
+			}
+
+			file.releaseSpanHash();
+		}
+		else
+		{
+			response << "ERROR: " << error << "\n";
+		}
+
+		response << "\n";
+
+		if(!sendAll(fd, response.str()))
+		{
+			break;
+		}
+	}
+
+	fclose(in);
+}
@@ -0,0 +1,94 @@
+#ifndef QUERY_SERVER_HPP_INCLUDED
+#define QUERY_SERVER_HPP_INCLUDED
+
+
+#include <stddef.h> // for size_t
+
+#include <string>
+#include <vector>
+
+#include "file_info.hpp"
+#include "matcher.hpp"
+
+
+/**
+Answer "which indexed files are similar to this one" queries over a Unix
+domain socket.
+
+Digests and fingerprints of all indexed files are loaded once and kept in
+memory. Each connection is served by its own thread, so queries run
+concurrently and a client that keeps its connection open doesn't hold up
+the others. At most 64 connections are served at a time, further clients
+wait until one of them is closed.
+
+Protocol is line based, a connection may carry any number of requests:
+
+	PATH <count> <path>\n
+	DATA <count> <size>\n<size bytes of data>
+
+Response lists up to `count` best matches in descending similarity order
+(exact matches first), one `<similarity>|<name>` line per match, followed by
+an empty line. Failed requests are answered with `ERROR: <message>` line
+followed by an empty line.
+*/
+class QueryServer
+{
+public:
+	struct Result
+	{
+		Result(float similarity, const FileInfo* fileInfo):
+			similarity(similarity),
+			fileInfo(fileInfo)
+		{
+		}
+
+		float similarity;
+		const FileInfo* fileInfo;
+	};
+
+	typedef std::vector<Result> Results;
+
+	/**
+	`files` must outlive the server. Only `minSimilarity`, `textOnly`,
+	`fingerprint` and `cache` options are used.
+	*/
+	QueryServer(FileList& files, const Matcher::Options& options);
+	~QueryServer();
+
+	QueryServer(const QueryServer&) = delete;
+	QueryServer& operator=(const QueryServer&) = delete;
+
+	/**
+	Read all files and keep their fingerprints in memory.
+	*/
+	void load();
+
+	/**
+	Find up to `count` files most similar to the given one. `file` must be
+	read and its fingerprint acquired. Safe to call from several threads.
+	*/
+	Results query(const FileInfo& file, size_t count) const;
+
+	/**
+	Create socket at the given path, an existing socket file is replaced.
+	*/
+	bool listen(const std::string& socketPath);
+
+	/**
+	Accept and serve connections until an error occurs.
+	*/
+	void run();
+
+private:
+	FileList& files_;
+	Matcher::Options options_;
+	DigestIndex digestIndex_;
+	std::string socketPath_;
+	int fd_;
+
+	void serve(int fd) const;
+
+};
+
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef SERIALIZE_HPP_INCLUDED
+#define SERIALIZE_HPP_INCLUDED
+
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <istream>
+#include <ostream>
+
+
+/**
+Helpers for binary state files. Values are stored in native byte order, so
+the files are not portable between architectures.
+*/
+namespace Serialize
+{
+
+	template<typename T>
+	void write(std::ostream& out, const T& v)
+	{
+		out.write(reinterpret_cast<const char*>(&v), sizeof(v));
+	}
+
+	template<typename T>
+	bool read(std::istream& in, T& v)
+	{
+		in.read(reinterpret_cast<char*>(&v), sizeof(v));
+		return static_cast<size_t>(in.gcount()) == sizeof(v);
+	}
+
+	/**
+	Unsigned value in 7 bit groups, small values take a single byte.
+	*/
+	inline void writeVarint(std::ostream& out, uint64_t v)
+	{
+		while(v >= 0x80)
+		{
+			out.put(static_cast<char>(v | 0x80));
+			v >>= 7;
+		}
+
+		out.put(static_cast<char>(v));
+	}
+
+	inline bool readVarint(std::istream& in, uint64_t& v)
+	{
+		v = 0;
+		for(unsigned shift = 0; shift < 64; shift += 7)
+		{
+			const int c = in.get();
+			if(c == std::char_traits<char>::eof())
+			{
+				return false;
+			}
+
+			v |= static_cast<uint64_t>(c & 0x7F) << shift;
+			if((c & 0x80) == 0)
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	inline void writeString(std::ostream& out, const std::string& v)
+	{
+		write<uint64_t>(out, v.size());
+		out.write(v.data(), v.size());
+	}
+
+	/**
+	The stored size is not trusted: the string grows by chunks as its data
+	is read, so a corrupted size fails at the end of the stream instead of
+	allocating it at once.
+	*/
+	inline bool readString(std::istream& in, std::string& v)
+	{
+		const uint64_t CHUNK_SIZE = 65536;
+
+		uint64_t size = 0;
+		if(!read(in, size))
+		{
+			return false;
+		}
+
+		v.clear();
+		while(v.size() != size)
+		{
+			const size_t begin = v.size();
+			const size_t length = static_cast<size_t>(std::min(size - begin, CHUNK_SIZE));
+
+			v.resize(begin + length);
+			in.read(&v[begin], length);
+			if(static_cast<size_t>(in.gcount()) != length)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+}
+
+
+#endif
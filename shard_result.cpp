@@ -0,0 +1,373 @@
+#include "shard_result.hpp"
+#include "serialize.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include <string.h>
+
+
+namespace
+{
+
+	const char MAGIC[8] = { 'S', 'I', 'M', 'S', 'H', 'D', '0', '4' };
+
+	// position of a file that is not in the list
+	const uint32_t NO_POSITION = static_cast<uint32_t>(-1);
+
+}
+
+
+ShardResult::ShardResult():
+	options_(),
+	selfCompare_(false),
+	shards_(),
+	source_(),
+	destination_(),
+	pairs_()
+{
+}
+
+
+void ShardResult::assign(const Matcher::Options& options, const FileList& source, const FileList& destination, Matcher::Edges&& pairs)
+{
+	options_ = options;
+	options_.cache = nullptr;
+	selfCompare_ = (&source == &destination);
+
+	shards_.clear();
+	shards_.insert(options.shardIndex);
+
+	assignFiles(source_, source);
+	if(selfCompare_)
+	{
+		destination_.clear();
+	}
+	else
+	{
+		assignFiles(destination_, destination);
+	}
+
+	pairs_ = std::move(pairs);
+}
+
+
+bool ShardResult::save(const std::string& fileName) const
+{
+	std::ofstream out(fileName, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+	if(!out.is_open())
+	{
+		std::cerr << "ERROR: failed to open file: '" << fileName << "'" << std::endl;
+		return false;
+	}
+
+	Serialize::write(out, MAGIC);
+	Serialize::write<uint64_t>(out, options_.shardIndex);
+	Serialize::write<uint64_t>(out, options_.shardCount);
+	Serialize::write<float>(out, options_.minSimilarity);
+	Serialize::write<uint8_t>(out, options_.all);
+	Serialize::write<uint8_t>(out, options_.textOnly);
+	Serialize::write<uint64_t>(out, options_.maxMatchesPerFile);
+	Serialize::write<uint8_t>(out, options_.approx);
+	Serialize::write<float>(out, options_.approxMargin);
+	Serialize::write<uint8_t>(out, selfCompare_);
+	Serialize::write<uint8_t>(out, options_.fingerprint.binaryChunking);
+	Serialize::write<uint64_t>(out, options_.fingerprint.samplingThreshold);
+
+	writeFiles(out, source_);
+	writeFiles(out, destination_);
+
+	Serialize::write<uint64_t>(out, pairs_.size());
+	for(const auto& pair: pairs_)
+	{
+		Serialize::write(out, pair.similarity);
+		Serialize::write(out, pair.source);
+		Serialize::write(out, pair.destination);
+	}
+
+	return out.good();
+}
+
+
+bool ShardResult::load(const std::string& fileName)
+{
+	std::ifstream in(fileName, std::ios_base::in | std::ios_base::binary);
+	if(!in.is_open())
+	{
+		std::cerr << "ERROR: failed to open file: '" << fileName << "'" << std::endl;
+		return false;
+	}
+
+	char magic[sizeof(MAGIC)];
+	uint64_t shardIndex = 0;
+	uint64_t shardCount = 0;
+	float minSimilarity = 0.0f;
+	uint8_t all = 0;
+	uint8_t textOnly = 0;
+	uint64_t maxMatchesPerFile = 0;
+	uint8_t approx = 0;
+	float approxMargin = 0.0f;
+	uint8_t selfCompare = 0;
+	uint8_t binaryChunking = 0;
+	uint64_t samplingThreshold = 0;
+
+	if(
+		!Serialize::read(in, magic) ||
+		memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+		!Serialize::read(in, shardIndex) ||
+		!Serialize::read(in, shardCount) ||
+		!Serialize::read(in, minSimilarity) ||
+		!Serialize::read(in, all) ||
+		!Serialize::read(in, textOnly) ||
+		!Serialize::read(in, maxMatchesPerFile) ||
+		!Serialize::read(in, approx) ||
+		!Serialize::read(in, approxMargin) ||
+		!Serialize::read(in, selfCompare) ||
+		!Serialize::read(in, binaryChunking) ||
+		!Serialize::read(in, samplingThreshold) ||
+		shardIndex >= shardCount)
+	{
+		std::cerr << "ERROR: invalid shard result: '" << fileName << "'" << std::endl;
+		return false;
+	}
+
+	options_ = Matcher::Options();
+	options_.minSimilarity = minSimilarity;
+	options_.all = (all != 0);
+	options_.textOnly = (textOnly != 0);
+	options_.maxMatchesPerFile = maxMatchesPerFile;
+	options_.approx = (approx != 0);
+	options_.approxMargin = approxMargin;
+	options_.fingerprint.binaryChunking = (binaryChunking != 0);
+	options_.fingerprint.samplingThreshold = samplingThreshold;
+	options_.shardIndex = shardIndex;
+	options_.shardCount = shardCount;
+	selfCompare_ = (selfCompare != 0);
+
+	shards_.clear();
+	shards_.insert(shardIndex);
+
+	uint64_t count = 0;
+	bool ok =
+		readFiles(in, source_) &&
+		readFiles(in, destination_) &&
+		Serialize::read(in, count);
+
+	const size_t sourceCount = source_.size();
+	const size_t destinationCount = selfCompare_ ? source_.size() : destination_.size();
+
+	pairs_.clear();
+	for(uint64_t i = 0; ok && i != count; ++i)
+	{
+		Matcher::Edge pair(0.0f, 0, 0);
+		ok =
+			Serialize::read(in, pair.similarity) &&
+			Serialize::read(in, pair.source) &&
+			Serialize::read(in, pair.destination) &&
+			pair.source < sourceCount &&
+			pair.destination < destinationCount;
+
+		pairs_.push_back(pair);
+	}
+
+	if(!ok)
+	{
+		std::cerr << "ERROR: truncated shard result: '" << fileName << "'" << std::endl;
+		pairs_.clear();
+		return false;
+	}
+
+	return true;
+}
+
+
+bool ShardResult::merge(ShardResult&& that)
+{
+	if(
+		that.options_.minSimilarity != options_.minSimilarity ||
+		that.options_.all != options_.all ||
+		that.options_.textOnly != options_.textOnly ||
+		that.options_.maxMatchesPerFile != options_.maxMatchesPerFile ||
+		that.options_.approx != options_.approx ||
+		that.options_.approxMargin != options_.approxMargin ||
+		that.options_.fingerprint.binaryChunking != options_.fingerprint.binaryChunking ||
+		that.options_.fingerprint.samplingThreshold != options_.fingerprint.samplingThreshold ||
+		that.options_.shardCount != options_.shardCount)
+	{
+		std::cerr << "ERROR: shard results were produced with different options" << std::endl;
+		return false;
+	}
+
+	if(that.selfCompare_ != selfCompare_ || !(that.source_ == source_) || !(that.destination_ == destination_))
+	{
+		std::cerr << "ERROR: shard results were produced from different files" << std::endl;
+		return false;
+	}
+
+	if(shards_.count(that.options_.shardIndex) != 0)
+	{
+		std::cerr << "ERROR: shard " << that.options_.shardIndex << "/" << that.options_.shardCount << " is given twice" << std::endl;
+		return false;
+	}
+
+	shards_.insert(that.options_.shardIndex);
+	pairs_.insert(pairs_.end(), that.pairs_.begin(), that.pairs_.end());
+
+	return true;
+}
+
+
+bool ShardResult::isComplete() const
+{
+	// indices are below the shard count, so all of them are there
+	return shards_.size() == options_.shardCount;
+}
+
+
+void ShardResult::report(const Matcher::MatchCallback& callback) const
+{
+	// files are re-created from digests in the same order, so exact matches
+	// and ties are resolved the same way as in a single run
+	FileList source;
+	FileList destinationStorage;
+	std::vector<uint32_t> sourcePositions;
+	std::vector<uint32_t> destinationPositionsStorage;
+
+	buildList(source_, source, sourcePositions);
+	if(!selfCompare_)
+	{
+		buildList(destination_, destinationStorage, destinationPositionsStorage);
+	}
+
+	FileList& destination = selfCompare_ ? source : destinationStorage;
+	const std::vector<uint32_t>& destinationPositions = selfCompare_ ? sourcePositions : destinationPositionsStorage;
+
+	Matcher::Options options = options_;
+	options.shardIndex = 0;
+	options.shardCount = 1;
+
+	Matcher matcher(source, destination, options);
+	matcher.setMatchCallback(callback);
+	matcher.hash();
+	matcher.findExactMatches();
+
+	Matcher::Edges pairs;
+	pairs.reserve(pairs_.size());
+	for(const auto& pair: pairs_)
+	{
+		const uint32_t src = sourcePositions[pair.source];
+		const uint32_t dst = destinationPositions[pair.destination];
+		if(src != NO_POSITION && dst != NO_POSITION)
+		{
+			pairs.emplace_back(pair.similarity, src, dst);
+		}
+	}
+
+	if(options.all)
+	{
+		std::sort(pairs.begin(), pairs.end(), [](const Matcher::Edge& lhs, const Matcher::Edge& rhs)
+		{
+			if(lhs.source != rhs.source)
+			{
+				return lhs.source < rhs.source;
+			}
+
+			return lhs.destination < rhs.destination;
+		});
+
+		for(const auto& pair: pairs)
+		{
+			callback(pair.similarity, source[pair.source], destination[pair.destination]);
+		}
+	}
+	else
+	{
+		for(const auto& pair: pairs)
+		{
+			matcher.addMatch(pair.source, pair.destination, pair.similarity);
+		}
+
+		matcher.dumpMatches();
+	}
+}
+
+
+void ShardResult::assignFiles(Files& files, const FileList& list)
+{
+	files.resize(list.size());
+	for(size_t i = 0; i != list.size(); ++i)
+	{
+		File& file = files[i];
+		file.name = list[i].name();
+		file.size = list[i].size();
+		file.digest = list[i].digest();
+
+		// digest of a file that failed to read stays empty
+		file.valid = (file.digest != FileDigest());
+	}
+}
+
+
+void ShardResult::writeFiles(std::ostream& out, const Files& files)
+{
+	Serialize::write<uint64_t>(out, files.size());
+	for(const auto& file: files)
+	{
+		Serialize::writeString(out, file.name);
+		Serialize::write(out, file.size);
+		Serialize::write<uint8_t>(out, file.valid);
+		out.write(reinterpret_cast<const char*>(file.digest.data()), 20);
+	}
+}
+
+
+bool ShardResult::readFiles(std::istream& in, Files& files)
+{
+	uint64_t count = 0;
+	if(!Serialize::read(in, count))
+	{
+		return false;
+	}
+
+	files.clear();
+	for(uint64_t i = 0; i != count; ++i)
+	{
+		File file;
+		uint8_t valid = 0;
+		if(
+			!Serialize::readString(in, file.name) ||
+			!Serialize::read(in, file.size) ||
+			!Serialize::read(in, valid) ||
+			!in.read(reinterpret_cast<char*>(file.digest.data()), 20))
+		{
+			return false;
+		}
+
+		file.valid = (valid != 0);
+		files.push_back(std::move(file));
+	}
+
+	return true;
+}
+
+
+void ShardResult::buildList(const Files& files, FileList& list, std::vector<uint32_t>& positions)
+{
+	// files that failed to read take no part in matching
+	positions.assign(files.size(), NO_POSITION);
+	list.reserve(files.size());
+
+	for(size_t i = 0; i != files.size(); ++i)
+	{
+		const File& file = files[i];
+		if(!file.valid)
+		{
+			continue;
+		}
+
+		positions[i] = list.size();
+		list.emplace_back(file.name, file.size);
+		list.back().assign(false, file.digest, SpanHash());
+	}
+}
@@ -0,0 +1,93 @@
+#ifndef SHARD_RESULT_HPP_INCLUDED
+#define SHARD_RESULT_HPP_INCLUDED
+
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "file_digest.hpp"
+#include "file_info.hpp"
+#include "matcher.hpp"
+
+
+/**
+Partial result of a sharded run (see Matcher::Options::shardIndex): options,
+digests of all files and similar pairs found by the shard.
+
+Partial results of all shards merged together produce the same report as a
+single run over the same files would produce. Exact matches are searched
+again on merge, so files are not read.
+*/
+class ShardResult
+{
+public:
+	ShardResult();
+
+	/**
+	Take options, file lists and similar pairs of a shard. `pairs` are all
+	reported pairs in `all` mode and Matcher::similarPairs() otherwise.
+	*/
+	void assign(const Matcher::Options& options, const FileList& source, const FileList& destination, Matcher::Edges&& pairs);
+
+	bool save(const std::string& fileName) const;
+	bool load(const std::string& fileName);
+
+	/**
+	Add result of another shard of the same run.
+	*/
+	bool merge(ShardResult&& that);
+
+	/**
+	Check if results of all shards are merged.
+	*/
+	bool isComplete() const;
+
+	/**
+	Report matches the same way Matcher reports them.
+	*/
+	void report(const Matcher::MatchCallback& callback) const;
+
+private:
+	struct File
+	{
+		File():
+			name(),
+			size(0),
+			valid(false),
+			digest()
+		{
+		}
+
+		bool operator==(const File& that) const
+		{
+			return name == that.name && size == that.size && valid == that.valid && digest == that.digest;
+		}
+
+		std::string name;
+		uint64_t size;
+		bool valid;
+		FileDigest digest;
+	};
+
+	typedef std::vector<File> Files;
+
+	Matcher::Options options_;
+	bool selfCompare_;
+	std::set<uint64_t> shards_; // indices of merged shards
+	Files source_;
+	Files destination_;
+	Matcher::Edges pairs_;
+
+	static void assignFiles(Files& files, const FileList& list);
+	static void writeFiles(std::ostream& out, const Files& files);
+	static bool readFiles(std::istream& in, Files& files);
+	static void buildList(const Files& files, FileList& list, std::vector<uint32_t>& positions);
+
+};
+
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef SIMILAR_HPP_INCLUDED
+#define SIMILAR_HPP_INCLUDED
+
+
+/**
+Public interface of libsimilar.
+
+- FileInfo and FileList describe files and their fingerprints, PathStore
+  keeps their paths;
+- addPath() and addListFile() populate file lists;
+- SpanHash calculates similarity of two fingerprints;
+- Fingerprint and FingerprintCache keep resumable fingerprint state;
+- Matcher finds exact and similar files and best one to one matches.
+*/
+
+
+#include "file_digest.hpp"
+#include "file_info.hpp"
+#include "path_store.hpp"
+#include "file_list.hpp"
+#include "spanhash.hpp"
+#include "fingerprint.hpp"
+#include "fingerprint_cache.hpp"
+#include "matcher.hpp"
+#include "watcher.hpp"
+#include "watch_index.hpp"
+#include "query_server.hpp"
+#include "index_file.hpp"
+#include "shard_result.hpp"
+
+
+#endif
@@ -1,26 +1,901 @@
 #include "spanhash.hpp"
+#include "serialize.hpp"
 #include <utility>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <stdexcept>
+#include <vector>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPANHASH_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+namespace
+{
+
+	const size_t READ_CHUNK = 64 * 1024;
+
+	// span is finished at LF or when it reaches this length
+	const unsigned MAX_SPAN_LENGTH = 64;
+
+	// content-defined chunk is finished when the top bits of the gear hash
+	// are zero, which happens every 64 bytes on average
+	const unsigned MIN_CHUNK_LENGTH = 16;
+	const unsigned MAX_CHUNK_LENGTH = 256;
+	const unsigned CHUNK_BOUNDARY_SHIFT = 64 - 6;
+
+	/**
+	Random value for each byte, mixed into the gear hash.
+	*/
+	struct GearTable
+	{
+		uint64_t values[256];
+
+		GearTable()
+		{
+			// splitmix64, the table must never change as fingerprints are stored
+			uint64_t state = 0x5EED5EED5EED5EEDull;
+			for(auto& v: values)
+			{
+				state += 0x9E3779B97F4A7C15ull;
+				uint64_t z = state;
+				z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+				z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+				v = z ^ (z >> 31);
+			}
+		}
+	};
+
+	const GearTable GEAR;
+
+	// sampled fingerprint keeps one of this many hash values
+	const unsigned SAMPLE_RATE = 16;
+
+	// dense fingerprint takes 4 bytes per possible hash value, sparse one
+	// takes 12 bytes per entry
+	const size_t DENSE_MIN_ENTRIES = Hasher::HASH_COUNT / 3;
+
+	// maxSimilarity() sums span lengths in this many buckets of hash values
+	const unsigned SKETCH_BITS = 8;
+	const size_t SKETCH_SIZE = size_t(1) << SKETCH_BITS;
+
+	inline unsigned sketchBucket(Hasher::Hash hash)
+	{
+		// multiplicative hashing, sampled hashes are all divisible by
+		// SAMPLE_RATE so their low bits can't be used directly
+		return static_cast<uint32_t>(hash * 2654435761u) >> (32 - SKETCH_BITS);
+	}
+
+
+	void writeVarint(std::vector<uint8_t>& out, uint64_t v)
+	{
+		while(v >= 0x80)
+		{
+			out.push_back(static_cast<uint8_t>(v | 0x80));
+			v >>= 7;
+		}
+
+		out.push_back(static_cast<uint8_t>(v));
+	}
+
+	inline uint64_t readVarint(const uint8_t*& p)
+	{
+		// most counts and hash deltas fit into one or two bytes
+		uint64_t v = *p++;
+		if(v < 0x80)
+		{
+			return v;
+		}
+
+		v &= 0x7F;
+		for(unsigned shift = 7; ; shift += 7)
+		{
+			const uint64_t b = *p++;
+			v |= (b & 0x7F) << shift;
+			if(b < 0x80)
+			{
+				return v;
+			}
+		}
+	}
+
+	/**
+	Sequential reader of sorted entries stored as arrays.
+	*/
+	class ArrayEntries
+	{
+	public:
+		ArrayEntries(const Hasher::Hash* hashes, const SpanHash::Count* counts, size_t count):
+			hashes_(hashes),
+			counts_(counts),
+			end_(hashes + count)
+		{
+		}
+
+		bool isEnd() const
+		{
+			return hashes_ == end_;
+		}
+
+		Hasher::Hash hash() const
+		{
+			return *hashes_;
+		}
+
+		SpanHash::Count count() const
+		{
+			return *counts_;
+		}
+
+		void next()
+		{
+			++hashes_;
+			++counts_;
+		}
+
+	private:
+		const Hasher::Hash* hashes_;
+		const SpanHash::Count* counts_;
+		const Hasher::Hash* end_;
+
+	};
+
+	/**
+	Sequential reader of compressed entries, decodes them on the fly.
+	*/
+	class VarintEntries
+	{
+	public:
+		VarintEntries(const uint8_t* data, size_t size):
+			p_(data),
+			end_(data + size),
+			atEnd_(false),
+			hash_(0),
+			count_(0)
+		{
+			next();
+		}
+
+		bool isEnd() const
+		{
+			return atEnd_;
+		}
+
+		Hasher::Hash hash() const
+		{
+			return hash_;
+		}
+
+		SpanHash::Count count() const
+		{
+			return count_;
+		}
+
+		void next()
+		{
+			if(p_ == end_)
+			{
+				atEnd_ = true;
+				return;
+			}
+
+			hash_ += static_cast<Hasher::Hash>(readVarint(p_));
+			count_ = readVarint(p_);
+		}
+
+	private:
+		const uint8_t* p_;
+		const uint8_t* end_;
+		bool atEnd_;
+		Hasher::Hash hash_;
+		SpanHash::Count count_;
+
+	};
+
+	// arrays that differ in size more than this are intersected by galloping
+	const size_t GALLOP_RATIO = 32;
+
+#ifdef SPANHASH_X86_SIMD
+	bool hasAvx2()
+	{
+		static const bool result = __builtin_cpu_supports("avx2");
+		return result;
+	}
+#endif
+
+	uint64_t minSumDenseScalar(const uint32_t* a, const uint32_t* b, size_t n)
+	{
+		uint64_t result = 0;
+		for(size_t i = 0; i != n; ++i)
+		{
+			result += std::min(a[i], b[i]);
+		}
+
+		return result;
+	}
+
+#ifdef SPANHASH_X86_SIMD
+	__attribute__((target("avx2")))
+	uint64_t minSumDenseAvx2(const uint32_t* a, const uint32_t* b, size_t n)
+	{
+		const __m256i low = _mm256_set1_epi64x(0xFFFFFFFF);
+
+		// four 64 bit sums, each one takes two 32 bit minimums per step
+		__m256i sum = _mm256_setzero_si256();
+
+		size_t i = 0;
+		for(; i + 8 <= n; i += 8)
+		{
+			const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+			const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+			const __m256i m = _mm256_min_epu32(va, vb);
+
+			sum = _mm256_add_epi64(sum, _mm256_and_si256(m, low));
+			sum = _mm256_add_epi64(sum, _mm256_srli_epi64(m, 32));
+		}
+
+		uint64_t sums[4];
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(sums), sum);
+
+		return sums[0] + sums[1] + sums[2] + sums[3] + minSumDenseScalar(a + i, b + i, n - i);
+	}
+#endif
+
+	/**
+	Sum of minimum counts of two dense fingerprints.
+	*/
+	uint64_t minSumDense(const uint32_t* a, const uint32_t* b)
+	{
+#ifdef SPANHASH_X86_SIMD
+		if(hasAvx2())
+		{
+			return minSumDenseAvx2(a, b, Hasher::HASH_COUNT);
+		}
+#endif
+
+		return minSumDenseScalar(a, b, Hasher::HASH_COUNT);
+	}
+
+	/**
+	Sum of minimum counts of sparse and dense fingerprints. Dense one is
+	never sampled, and sampled sparse one contains selected hashes only.
+	Hashes of mapped index files are not checked when they are opened, those
+	out of range are skipped here.
+	*/
+	template<typename Entries>
+	uint64_t minSumSparseDense(Entries entries, const uint32_t* dense)
+	{
+		uint64_t result = 0;
+		for(; !entries.isEnd(); entries.next())
+		{
+			const Hasher::Hash hash = entries.hash();
+			if(hash < Hasher::HASH_COUNT)
+			{
+				result += std::min<SpanHash::Count>(entries.count(), dense[hash]);
+			}
+		}
+
+		return result;
+	}
+
+	/**
+	Sum of minimum counts of two sparse fingerprints.
+	*/
+	template<typename Entries1, typename Entries2>
+	uint64_t minSumSparse(Entries1 entries1, Entries2 entries2, unsigned sampleRate)
+	{
+		uint64_t result = 0;
+
+		// both entry sequences are sorted, walk them together
+		while(!entries1.isEnd() && !entries2.isEnd())
+		{
+			if(entries1.hash() < entries2.hash())
+			{
+				entries1.next();
+			}
+			else if(entries2.hash() < entries1.hash())
+			{
+				entries2.next();
+			}
+			else
+			{
+				if(sampleRate == 1 || entries1.hash() % sampleRate == 0)
+				{
+					result += std::min(entries1.count(), entries2.count());
+				}
+
+				entries1.next();
+				entries2.next();
+			}
+		}
+
+		return result;
+	}
+
+	template<typename Entries1>
+	uint64_t minSumSparse(Entries1 entries1, const SpanHash& that, unsigned sampleRate)
+	{
+		if(that.isCompressed())
+		{
+			return minSumSparse(entries1, VarintEntries(that.compressed(), that.compressedSize()), sampleRate);
+		}
+		else
+		{
+			return minSumSparse(entries1, ArrayEntries(that.hashes(), that.counts(), that.entryCount()), sampleRate);
+		}
+	}
+
+	/**
+	Sorted hash array with counts, the part of an uncompressed sparse
+	fingerprint that is intersected.
+	*/
+	struct SortedArray
+	{
+		const Hasher::Hash* hashes;
+		const SpanHash::Count* counts;
+		size_t size;
+	};
+
+	inline uint64_t matchedCount(const SortedArray& a, size_t i, const SortedArray& b, size_t j, unsigned sampleRate)
+	{
+		if(sampleRate != 1 && a.hashes[i] % sampleRate != 0)
+		{
+			return 0;
+		}
+
+		return std::min(a.counts[i], b.counts[j]);
+	}
+
+	/**
+	Scalar intersection of sorted arrays starting from given positions.
+	*/
+	uint64_t minSumArraysScalar(const SortedArray& a, size_t i, const SortedArray& b, size_t j, unsigned sampleRate)
+	{
+		uint64_t result = 0;
+		while(i != a.size && j != b.size)
+		{
+			if(a.hashes[i] < b.hashes[j])
+			{
+				i += 1;
+			}
+			else if(b.hashes[j] < a.hashes[i])
+			{
+				j += 1;
+			}
+			else
+			{
+				result += matchedCount(a, i, b, j, sampleRate);
+				i += 1;
+				j += 1;
+			}
+		}
+
+		return result;
+	}
+
+	/**
+	Intersection of a small array with a much larger one: each hash of the
+	small array is searched in the rest of the large one with exponentially
+	growing steps, then by binary search.
+	*/
+	uint64_t minSumArraysGallop(const SortedArray& small, const SortedArray& large, unsigned sampleRate)
+	{
+		uint64_t result = 0;
+		size_t j = 0;
+		for(size_t i = 0; i != small.size && j != large.size; ++i)
+		{
+			const Hasher::Hash hash = small.hashes[i];
+
+			size_t step = 1;
+			size_t bound = j;
+			while(bound < large.size && large.hashes[bound] < hash)
+			{
+				j = bound + 1;
+				bound += step;
+				step *= 2;
+			}
+
+			const Hasher::Hash* end = large.hashes + std::min(bound + 1, large.size);
+			j = std::lower_bound(large.hashes + j, end, hash) - large.hashes;
+
+			if(j != large.size && large.hashes[j] == hash)
+			{
+				result += matchedCount(small, i, large, j, sampleRate);
+				j += 1;
+			}
+		}
+
+		return result;
+	}
+
+#ifdef SPANHASH_X86_SIMD
+	/**
+	Block intersection: each 8 hashes of one array are compared with all
+	rotations of 8 hashes of the other one, which also gives the position
+	of the matching hash. Counts of matches are then gathered and summed
+	without branches. Sampled fingerprints are small, they go to the
+	scalar kernel.
+	*/
+	__attribute__((target("avx2")))
+	uint64_t minSumArraysAvx2(const SortedArray& a, const SortedArray& b)
+	{
+		const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+		const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const long long* countsB = reinterpret_cast<const long long*>(b.counts);
+
+		__m256i sum = _mm256_setzero_si256();
+		size_t i = 0;
+		size_t j = 0;
+		while(i + 8 <= a.size && j + 8 <= b.size)
+		{
+			const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a.hashes + i));
+			__m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b.hashes + j));
+			__m256i positions = lanes; // positions of hashes in vb
+
+			__m256i equal = _mm256_cmpeq_epi32(va, vb);
+			__m256i matched = _mm256_and_si256(equal, positions);
+			for(int r = 1; r != 8; ++r)
+			{
+				vb = _mm256_permutevar8x32_epi32(vb, rotate);
+				positions = _mm256_permutevar8x32_epi32(positions, rotate);
+
+				const __m256i e = _mm256_cmpeq_epi32(va, vb);
+				equal = _mm256_or_si256(equal, e);
+				matched = _mm256_blendv_epi8(matched, positions, e);
+			}
+
+			if(!_mm256_testz_si256(equal, equal))
+			{
+				for(int half = 0; half != 2; ++half)
+				{
+					const __m128i halfMatched = half ? _mm256_extracti128_si256(matched, 1) : _mm256_castsi256_si128(matched);
+					const __m128i halfEqual = half ? _mm256_extracti128_si256(equal, 1) : _mm256_castsi256_si128(equal);
+
+					const __m256i ca = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a.counts + i + half * 4));
+					const __m256i cb = _mm256_i32gather_epi64(countsB + j, halfMatched, 8);
+
+					// counts are less than 2^63, so signed comparison selects minimums
+					const __m256i minimum = _mm256_blendv_epi8(ca, cb, _mm256_cmpgt_epi64(ca, cb));
+					sum = _mm256_add_epi64(sum, _mm256_and_si256(minimum, _mm256_cvtepi32_epi64(halfEqual)));
+				}
+			}
+
+			const Hasher::Hash lastA = a.hashes[i + 7];
+			const Hasher::Hash lastB = b.hashes[j + 7];
+			i += 8 * (lastA <= lastB);
+			j += 8 * (lastB <= lastA);
+		}
+
+		uint64_t sums[4];
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(sums), sum);
+
+		return sums[0] + sums[1] + sums[2] + sums[3] + minSumArraysScalar(a, i, b, j, 1);
+	}
+#endif
+
+	/**
+	Sum of minimum counts of two uncompressed sparse fingerprints. All
+	kernels give exactly the same result.
+	*/
+	uint64_t minSumArrays(const SortedArray& a, const SortedArray& b, unsigned sampleRate)
+	{
+		if(a.size > b.size * GALLOP_RATIO)
+		{
+			return minSumArraysGallop(b, a, sampleRate);
+		}
+
+		if(b.size > a.size * GALLOP_RATIO)
+		{
+			return minSumArraysGallop(a, b, sampleRate);
+		}
+
+#ifdef SPANHASH_X86_SIMD
+		if(sampleRate == 1 && hasAvx2())
+		{
+			return minSumArraysAvx2(a, b);
+		}
+#endif
+
+		return minSumArraysScalar(a, 0, b, 0, sampleRate);
+	}
+
+	/**
+	Sum of minimum counts of sparse fingerprint and any other one.
+	*/
+	uint64_t minSumSparse(const SpanHash& sparse, const SpanHash& that, unsigned sampleRate)
+	{
+		if(sparse.isCompressed())
+		{
+			VarintEntries entries(sparse.compressed(), sparse.compressedSize());
+			return that.isDense() ? minSumSparseDense(entries, that.dense()) : minSumSparse(entries, that, sampleRate);
+		}
+
+		if(that.isDense())
+		{
+			return minSumSparseDense(ArrayEntries(sparse.hashes(), sparse.counts(), sparse.entryCount()), that.dense());
+		}
+
+		if(that.isCompressed())
+		{
+			return minSumSparse(ArrayEntries(sparse.hashes(), sparse.counts(), sparse.entryCount()), that, sampleRate);
+		}
+
+		const SortedArray a = { sparse.hashes(), sparse.counts(), sparse.entryCount() };
+		const SortedArray b = { that.hashes(), that.counts(), that.entryCount() };
+		return minSumArrays(a, b, sampleRate);
+	}
+
+	/**
+	Text line endings: CR and CRLF are taken for LF. CR at the end of data
+	is kept pending as its meaning depends on the next byte.
+	*/
+	struct NormalizedLineEndings
+	{
+		template<typename Push>
+		static void put(unsigned char c, bool& pendingCR, Push& push)
+		{
+			if(pendingCR)
+			{
+				pendingCR = false;
+				if(c != '\n')
+				{
+					push('\n');
+				}
+			}
+
+			if(c == '\r')
+			{
+				pendingCR = true;
+				return;
+			}
+
+			push(c);
+		}
+	};
+
+	/**
+	Binary line endings: each CR is simply taken for LF.
+	*/
+	struct RawLineEndings
+	{
+		template<typename Push>
+		static void put(unsigned char c, bool& /* pendingCR */, Push& push)
+		{
+			push(c == '\r' ? '\n' : c);
+		}
+	};
+
+	/**
+	Span is finished at LF or when it reaches MAX_SPAN_LENGTH.
+	*/
+	struct LineSpans
+	{
+		static bool isEnd(unsigned char c, unsigned length, uint64_t& /* gear */)
+		{
+			return length >= MAX_SPAN_LENGTH || c == '\n';
+		}
+	};
+
+	/**
+	Content-defined chunks selected by the gear hash.
+	*/
+	struct GearChunks
+	{
+		static bool isEnd(unsigned char c, unsigned length, uint64_t& gear)
+		{
+			gear = (gear << 1) + GEAR.values[c];
+			return length >= MIN_CHUNK_LENGTH && (length >= MAX_CHUNK_LENGTH || (gear >> CHUNK_BOUNDARY_SHIFT) == 0);
+		}
+	};
+
+}
+
+
+SpanHash::Builder::Builder(bool binary, const Options& options):
+	options_(options),
+	binary_(binary),
+	chunked_(binary && options.binaryChunking),
+	hasher_(),
+	spanLength_(0),
+	pendingCR_(false),
+	gear_(0),
+	size_(0),
+	entries_()
+{
+}
+
+
+void SpanHash::Builder::addSpan(Hasher::Hash hash, unsigned length)
+{
+	// kept out of the byte loop, so the loop is small enough to be inlined
+	entries_[hash] += length;
+}
+
+
+template<typename LineEndings, typename Spans>
+void SpanHash::Builder::run(const unsigned char* p, const unsigned char* end)
+{
+	// work on local copies of the state, so it can stay in registers
+	Hasher hasher = hasher_;
+	unsigned spanLength = spanLength_;
+	bool pendingCR = pendingCR_;
+	uint64_t gear = gear_;
+	size_t size = size_;
+
+	auto push = [&](unsigned char c)
+	{
+		size += 1;
+
+		hasher.push(c);
+		spanLength += 1;
+		if(Spans::isEnd(c, spanLength, gear))
+		{
+			addSpan(hasher.stop(), spanLength);
+			spanLength = 0;
+		}
+	};
+
+	for(; p != end; ++p)
+	{
+		LineEndings::put(*p, pendingCR, push);
+	}
+
+	hasher_ = hasher;
+	spanLength_ = spanLength;
+	pendingCR_ = pendingCR;
+	gear_ = gear;
+	size_ = size;
+}
+
+
+void SpanHash::Builder::update(const void* data, size_t size)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	const unsigned char* end = p + size;
+
+	if(chunked_)
+	{
+		run<RawLineEndings, GearChunks>(p, end);
+	}
+	else if(binary_)
+	{
+		run<RawLineEndings, LineSpans>(p, end);
+	}
+	else
+	{
+		run<NormalizedLineEndings, LineSpans>(p, end);
+	}
+}
+
+
+SpanHash SpanHash::Builder::finish()
+{
+	if(pendingCR_)
+	{
+		// only text has pending CR
+		const unsigned char lf = '\n';
+		pendingCR_ = false;
+		run<RawLineEndings, LineSpans>(&lf, &lf + 1);
+	}
+
+	// incomplete span at the end of data is not taken into account
+
+	const uint64_t threshold = options_.samplingThreshold;
+	const unsigned sampleRate = (threshold != 0 && size_ >= threshold) ? SAMPLE_RATE : 1;
+
+	std::vector<std::pair<Hasher::Hash, size_t>> sorted;
+	if(sampleRate == 1)
+	{
+		sorted.assign(entries_.begin(), entries_.end());
+	}
+	else
+	{
+		// rule depends on hash only, so the same spans are kept in all files
+		for(const auto& entry: entries_)
+		{
+			if(entry.first % sampleRate == 0)
+			{
+				sorted.push_back(entry);
+			}
+		}
+	}
+
+	std::sort(sorted.begin(), sorted.end());
+
+	std::vector<Hasher::Hash> hashes;
+	std::vector<Count> counts;
+	hashes.reserve(sorted.size());
+	counts.reserve(sorted.size());
+	for(const auto& entry: sorted)
+	{
+		hashes.push_back(entry.first);
+		counts.push_back(entry.second);
+	}
+
+	SpanHash result;
+	result.valid_ = true;
+	result.size_ = size_;
+	result.sampleRate_ = sampleRate;
+	result.assign(std::move(hashes), std::move(counts), options_.compression);
+
+	Entries empty;
+	entries_.swap(empty);
+
+	hasher_.start();
+	spanLength_ = 0;
+	gear_ = 0;
+	size_ = 0;
+
+	return result;
+}
+
+
+void SpanHash::Builder::save(std::ostream& out) const
+{
+	const Hasher::State hasherState = hasher_.state();
+
+	Serialize::write<uint8_t>(out, binary_);
+	Serialize::write<uint8_t>(out, chunked_);
+	Serialize::write<uint32_t>(out, hasherState.accum1);
+	Serialize::write<uint32_t>(out, hasherState.accum2);
+	Serialize::write<uint32_t>(out, spanLength_);
+	Serialize::write<uint8_t>(out, pendingCR_);
+	Serialize::write<uint64_t>(out, gear_);
+	Serialize::write<uint64_t>(out, size_);
+	Serialize::write<uint64_t>(out, entries_.size());
+
+	// sorted entries are stored compressed as in SpanHash
+	std::vector<std::pair<Hasher::Hash, size_t>> sorted(entries_.begin(), entries_.end());
+	std::sort(sorted.begin(), sorted.end());
+
+	Hasher::Hash previous = 0;
+	for(const auto& entry: sorted)
+	{
+		Serialize::writeVarint(out, entry.first - previous);
+		Serialize::writeVarint(out, entry.second);
+		previous = entry.first;
+	}
+}
+
+
+bool SpanHash::Builder::load(std::istream& in)
+{
+	uint8_t binary = 0;
+	uint8_t chunked = 0;
+	uint32_t accum1 = 0;
+	uint32_t accum2 = 0;
+	uint32_t spanLength = 0;
+	uint8_t pendingCR = 0;
+	uint64_t gear = 0;
+	uint64_t size = 0;
+	uint64_t count = 0;
+
+	if(
+		!Serialize::read(in, binary) ||
+		!Serialize::read(in, chunked) ||
+		!Serialize::read(in, accum1) ||
+		!Serialize::read(in, accum2) ||
+		!Serialize::read(in, spanLength) ||
+		!Serialize::read(in, pendingCR) ||
+		!Serialize::read(in, gear) ||
+		!Serialize::read(in, size) ||
+		!Serialize::read(in, count))
+	{
+		return false;
+	}
+
+	if(count > Hasher::HASH_COUNT)
+	{
+		// more distinct hashes than there are
+		return false;
+	}
+
+	Entries entries;
+	entries.reserve(count);
+	uint64_t hash = 0;
+	for(uint64_t i = 0; i != count; ++i)
+	{
+		uint64_t delta = 0;
+		uint64_t n = 0;
+		if(!Serialize::readVarint(in, delta) || !Serialize::readVarint(in, n))
+		{
+			return false;
+		}
+
+		if(delta >= Hasher::HASH_COUNT - hash || (i != 0 && delta == 0))
+		{
+			// hashes index dense fingerprints, they must be sorted and in range
+			return false;
+		}
+
+		hash += delta;
+		entries[static_cast<Hasher::Hash>(hash)] = n;
+	}
+
+	Hasher::State hasherState;
+	hasherState.accum1 = accum1;
+	hasherState.accum2 = accum2;
+
+	binary_ = (binary != 0);
+	chunked_ = (chunked != 0);
+	hasher_.setState(hasherState);
+	spanLength_ = spanLength;
+	pendingCR_ = (pendingCR != 0);
+	gear_ = gear;
+	size_ = size;
+	entries_.swap(entries);
+
+	return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
 
 SpanHash::SpanHash():
 	valid_(false),
 	size_(0),
-	entries_()
+	sampleRate_(1),
+	hashStorage_(),
+	countStorage_(),
+	denseStorage_(),
+	compressedStorage_(),
+	hashes_(nullptr),
+	counts_(nullptr),
+	dense_(nullptr),
+	compressed_(nullptr),
+	compressedSize_(0),
+	entryCount_(0),
+	sketch_(),
+	sketchShift_(0)
 {
 }
 
 
+SpanHash::SpanHash(size_t size, const Hasher::Hash* hashes, const Count* counts, size_t count, unsigned sampleRate):
+	valid_(true),
+	size_(size),
+	sampleRate_(sampleRate),
+	hashStorage_(),
+	countStorage_(),
+	denseStorage_(),
+	compressedStorage_(),
+	hashes_(hashes),
+	counts_(counts),
+	dense_(nullptr),
+	compressed_(nullptr),
+	compressedSize_(0),
+	entryCount_(count),
+	sketch_(),
+	sketchShift_(0)
+{
+	// no sketch, index files are mapped to avoid per fingerprint memory
+}
+
+
 SpanHash::SpanHash(SpanHash&& that):
 	valid_(that.valid_),
 	size_(that.size_),
-	entries_(std::move(that.entries_))
+	sampleRate_(that.sampleRate_),
+	hashStorage_(std::move(that.hashStorage_)),
+	countStorage_(std::move(that.countStorage_)),
+	denseStorage_(std::move(that.denseStorage_)),
+	compressedStorage_(std::move(that.compressedStorage_)),
+	hashes_(that.hashes_),
+	counts_(that.counts_),
+	dense_(that.dense_),
+	compressed_(that.compressed_),
+	compressedSize_(that.compressedSize_),
+	entryCount_(that.entryCount_),
+	sketch_(std::move(that.sketch_)),
+	sketchShift_(that.sketchShift_)
 {
 	that.valid_ = false;
 	that.size_ = 0;
-	that.entries_.clear();
+	that.sampleRate_ = 1;
+	that.clear();
 }
 
 
@@ -28,11 +903,26 @@ SpanHash& SpanHash::operator=(SpanHash&& that)
 {
 	valid_ = that.valid_;
 	size_ = that.size_;
-	entries_ = std::move(that.entries_);
+	sampleRate_ = that.sampleRate_;
+
+	// moved vectors keep their buffers, so the pointers stay valid
+	hashStorage_ = std::move(that.hashStorage_);
+	countStorage_ = std::move(that.countStorage_);
+	denseStorage_ = std::move(that.denseStorage_);
+	compressedStorage_ = std::move(that.compressedStorage_);
+	hashes_ = that.hashes_;
+	counts_ = that.counts_;
+	dense_ = that.dense_;
+	compressed_ = that.compressed_;
+	compressedSize_ = that.compressedSize_;
+	entryCount_ = that.entryCount_;
+	sketch_ = std::move(that.sketch_);
+	sketchShift_ = that.sketchShift_;
 
 	that.valid_ = false;
 	that.size_ = 0;
-	that.entries_.clear();
+	that.sampleRate_ = 1;
+	that.clear();
 
 	return *this;
 }
@@ -40,7 +930,7 @@ SpanHash& SpanHash::operator=(SpanHash&& that)
 
 bool SpanHash::isEmpty() const
 {
-	return entries_.empty();
+	return entryCount_ == 0;
 }
 
 
@@ -50,11 +940,12 @@ bool SpanHash::isValid() const
 }
 
 
-bool SpanHash::init(const char* fileName, bool binary)
+bool SpanHash::init(const char* fileName, bool binary, const Options& options)
 {
 	valid_ = false;
 	size_ = 0;
-	entries_.clear();
+	sampleRate_ = 1;
+	clear();
 
 	std::ifstream stream(fileName, std::ios_base::in | std::ios_base::binary);
 	if(!stream.is_open())
@@ -63,75 +954,327 @@ bool SpanHash::init(const char* fileName, bool binary)
 		return false;
 	}
 
-	int n = 0;
-	Hasher hasher;
-	for(int c = stream.get(), next = stream.get(); c != EOF; c = next, next = stream.get())
+	Builder builder(binary, options);
+	std::vector<char> buffer(READ_CHUNK);
+	while(stream)
 	{
-		// don't distinguish between CR, LF, and CRLF
-		if(!binary && c == '\r' && next == '\n')
-		{
-			continue;
-		}
+		stream.read(buffer.data(), buffer.size());
+		builder.update(buffer.data(), stream.gcount());
+	}
+
+	*this = builder.finish();
+	return true;
+}
+
+
+void SpanHash::init(const void* data, size_t size, bool binary, const Options& options)
+{
+	Builder builder(binary, options);
+	builder.update(data, size);
+	*this = builder.finish();
+}
+
+
+void SpanHash::clear()
+{
+	// not just clear() to ensure there is no pre-allocated memory left
+	std::vector<Hasher::Hash> emptyHashes;
+	std::vector<Count> emptyCounts;
+	std::vector<uint32_t> emptyDense;
+	std::vector<uint8_t> emptyCompressed;
+	std::vector<uint16_t> emptySketch;
+	hashStorage_.swap(emptyHashes);
+	countStorage_.swap(emptyCounts);
+	denseStorage_.swap(emptyDense);
+	compressedStorage_.swap(emptyCompressed);
+	sketch_.swap(emptySketch);
+
+	hashes_ = nullptr;
+	counts_ = nullptr;
+	dense_ = nullptr;
+	compressed_ = nullptr;
+	compressedSize_ = 0;
+	entryCount_ = 0;
+	sketchShift_ = 0;
+}
+
+
+size_t SpanHash::entryCount() const
+{
+	return entryCount_;
+}
+
 
-		if(c == '\r')
+size_t SpanHash::memoryUsage() const
+{
+	// external memory is not counted
+	return
+		hashStorage_.capacity() * sizeof(Hasher::Hash) +
+		countStorage_.capacity() * sizeof(Count) +
+		denseStorage_.capacity() * sizeof(uint32_t) +
+		compressedStorage_.capacity() +
+		sketch_.capacity() * sizeof(uint16_t);
+}
+
+
+void SpanHash::entries(std::vector<Hasher::Hash>& hashes, std::vector<Count>& counts) const
+{
+	if(hashes_)
+	{
+		hashes.assign(hashes_, hashes_ + entryCount_);
+		counts.assign(counts_, counts_ + entryCount_);
+		return;
+	}
+
+	hashes.clear();
+	counts.clear();
+	hashes.reserve(entryCount_);
+	counts.reserve(entryCount_);
+
+	if(compressed_)
+	{
+		for(VarintEntries entries(compressed_, compressedSize_); !entries.isEnd(); entries.next())
 		{
-			c = '\n';
+			hashes.push_back(entries.hash());
+			counts.push_back(entries.count());
 		}
 
-		size_ += 1;
+		return;
+	}
+
+	if(!dense_)
+	{
+		// empty fingerprint
+		return;
+	}
 
-		hasher.push(static_cast<unsigned char>(c));
-		if(++n < 64 && c != '\n')
+	for(Hasher::Hash hash = 0; hash != Hasher::HASH_COUNT; ++hash)
+	{
+		if(dense_[hash] != 0)
 		{
-			continue;
+			hashes.push_back(hash);
+			counts.push_back(dense_[hash]);
 		}
+	}
+}
 
-		entries_[hasher.stop()] += n;
 
-		n = 0;
+float SpanHash::compare(const SpanHash& that) const
+{
+	if(size_ == 0 && that.size_ == 0)
+	{
+		return 1.0f;
 	}
 
-	valid_ = true;
-	return true;
+	if(size_ == 0 || that.size_ == 0)
+	{
+		return 0.0f;
+	}
+
+	// sample rates are either 1 or SAMPLE_RATE, so the greater one selects
+	// hashes kept in both fingerprints
+	const unsigned sampleRate = std::max(sampleRate_, that.sampleRate_);
+
+	uint64_t src_copied;
+	if(dense_ && that.dense_)
+	{
+		src_copied = minSumDense(dense_, that.dense_);
+	}
+	else if(dense_)
+	{
+		src_copied = minSumSparse(that, *this, sampleRate);
+	}
+	else
+	{
+		src_copied = minSumSparse(*this, that, sampleRate);
+	}
+
+	if(sampleRate == 1)
+	{
+		return
+			static_cast<float>(src_copied) /
+			static_cast<float>(std::max(size_, that.size_));
+	}
+
+	// spans are sampled by hash value, so each one is kept with probability
+	// 1/sampleRate
+	return std::min(1.0f,
+		static_cast<float>(src_copied) * sampleRate /
+		static_cast<float>(std::max(size_, that.size_)));
 }
 
 
-void SpanHash::clear()
+SpanHash SpanHash::sample() const
 {
-	// not just clear() to ensure there is no pre-allocated memory left
-	Entries empty;
-	entries_.swap(empty);
+	std::vector<Hasher::Hash> hashes;
+	std::vector<Count> counts;
+	entries(hashes, counts);
+
+	size_t kept = 0;
+	uint64_t total = 0;
+	for(size_t i = 0; i != hashes.size(); ++i)
+	{
+		if(hashes[i] % SAMPLE_RATE == 0)
+		{
+			hashes[kept] = hashes[i];
+			counts[kept] = counts[i];
+			total += counts[i];
+			kept += 1;
+		}
+	}
+
+	hashes.resize(kept);
+	counts.resize(kept);
+	hashes.shrink_to_fit();
+	counts.shrink_to_fit();
+
+	SpanHash result;
+	result.valid_ = valid_;
+	result.size_ = total * SAMPLE_RATE;
+	result.sampleRate_ = SAMPLE_RATE;
+	result.assign(std::move(hashes), std::move(counts), compressed_ != nullptr);
+	return result;
 }
 
 
-float SpanHash::compare(const SpanHash& that) const
+float SpanHash::maxSimilarity(const SpanHash& that) const
 {
-	if(size_ == 0 && that.size_ == 0)
+	if(size_ == 0 || that.size_ == 0 || sketch_.empty() || that.sketch_.empty())
 	{
+		// exact answer is cheap or there is no sketch
 		return 1.0f;
 	}
 
-	if(size_ == 0 || that.size_ == 0)
+	// compare() sums the smaller count of each common hash, which never
+	// exceeds the smaller total of the bucket holding it
+	// totals are rounded up, so the smaller one still bounds the sum
+	const uint16_t* a = sketch_.data();
+	const uint16_t* b = that.sketch_.data();
+	uint64_t bound = 0;
+	for(size_t i = 0; i != SKETCH_SIZE; ++i)
 	{
-		return 0.0f;
+		bound += std::min(uint64_t(a[i]) << sketchShift_, uint64_t(b[i]) << that.sketchShift_);
 	}
 
-	size_t src_copied = 0;
+	// same arithmetic as in compare() to keep the result an upper bound
+	const unsigned sampleRate = std::max(sampleRate_, that.sampleRate_);
+	if(sampleRate == 1)
+	{
+		return
+			static_cast<float>(bound) /
+			static_cast<float>(std::max(size_, that.size_));
+	}
+
+	return std::min(1.0f,
+		static_cast<float>(bound) * sampleRate /
+		static_cast<float>(std::max(size_, that.size_)));
+}
 
-	for(const auto& thisEntry: entries_)
+
+void SpanHash::assign(std::vector<Hasher::Hash>&& hashes, std::vector<Count>&& counts, bool compress)
+{
+	const bool dense =
+		sampleRate_ == 1 &&
+		hashes.size() >= DENSE_MIN_ENTRIES &&
+		std::all_of(counts.begin(), counts.end(), [](Count count)
+		{
+			return count <= UINT32_MAX;
+		});
+
+	if(dense)
 	{
-		auto thatEntryIt = that.entries_.find(thisEntry.first);
-		if(thatEntryIt == that.entries_.end())
+		denseStorage_.assign(Hasher::HASH_COUNT, 0);
+		for(size_t i = 0; i != hashes.size(); ++i)
 		{
-			continue;
+			denseStorage_[hashes[i]] = counts[i];
 		}
 
-		src_copied += std::min(thisEntry.second, thatEntryIt->second);
+		hashStorage_.clear();
+		countStorage_.clear();
+		hashes_ = nullptr;
+		counts_ = nullptr;
+		dense_ = denseStorage_.data();
+		compressed_ = nullptr;
+		compressedSize_ = 0;
+		entryCount_ = hashes.size();
+		buildSketch();
+		return;
 	}
 
-	return
-		static_cast<float>(src_copied) /
-		static_cast<float>(std::max(size_, that.size_));
+	if(compress)
+	{
+		compressedStorage_.clear();
+		Hasher::Hash previous = 0;
+		for(size_t i = 0; i != hashes.size(); ++i)
+		{
+			writeVarint(compressedStorage_, hashes[i] - previous);
+			writeVarint(compressedStorage_, counts[i]);
+			previous = hashes[i];
+		}
+
+		compressedStorage_.shrink_to_fit();
+		hashStorage_.clear();
+		countStorage_.clear();
+		hashes_ = nullptr;
+		counts_ = nullptr;
+		dense_ = nullptr;
+		compressed_ = compressedStorage_.data();
+		compressedSize_ = compressedStorage_.size();
+		entryCount_ = hashes.size();
+		buildSketch();
+		return;
+	}
+
+	hashStorage_ = std::move(hashes);
+	countStorage_ = std::move(counts);
+	hashes_ = hashStorage_.data();
+	counts_ = countStorage_.data();
+	dense_ = nullptr;
+	compressed_ = nullptr;
+	compressedSize_ = 0;
+	entryCount_ = hashStorage_.size();
+	buildSketch();
 }
 
 
+void SpanHash::buildSketch()
+{
+	uint64_t totals[SKETCH_SIZE] = {};
+	if(hashes_)
+	{
+		for(size_t i = 0; i != entryCount_; ++i)
+		{
+			totals[sketchBucket(hashes_[i])] += counts_[i];
+		}
+	}
+	else if(compressed_)
+	{
+		for(VarintEntries entries(compressed_, compressedSize_); !entries.isEnd(); entries.next())
+		{
+			totals[sketchBucket(entries.hash())] += entries.count();
+		}
+	}
+	else if(dense_)
+	{
+		for(Hasher::Hash hash = 0; hash != Hasher::HASH_COUNT; ++hash)
+		{
+			totals[sketchBucket(hash)] += dense_[hash];
+		}
+	}
+
+	// 16 bits per bucket, the unit grows with the largest total so that it
+	// fits after rounding up
+	const uint64_t largest = *std::max_element(totals, totals + SKETCH_SIZE);
+	sketchShift_ = 0;
+	while((largest >> sketchShift_) >= UINT16_MAX)
+	{
+		sketchShift_ += 1;
+	}
+
+	const uint64_t round = (uint64_t(1) << sketchShift_) - 1;
+	sketch_.resize(SKETCH_SIZE);
+	for(size_t i = 0; i != SKETCH_SIZE; ++i)
+	{
+		sketch_[i] = static_cast<uint16_t>((totals[i] >> sketchShift_) + ((totals[i] & round) != 0));
+	}
+}
@@ -2,7 +2,11 @@
 #define SPANHASH_HPP_INCLUDED
 
 
+#include <stddef.h> // for size_t
+#include <stdint.h>
 #include <unordered_map>
+#include <vector>
+#include <iosfwd>
 #include "hasher.hpp"
 
 
@@ -12,25 +16,252 @@
  */
 class SpanHash
 {
+	typedef std::unordered_map<Hasher::Hash, size_t> Entries;
+
 public:
+	/**
+	Total length of spans with the same hash.
+	*/
+	typedef uint64_t Count;
+
+	/**
+	Settings fingerprints are built with. Only fingerprints built with the
+	same settings can be compared.
+	*/
+	struct Options
+	{
+		Options():
+			binaryChunking(false),
+			samplingThreshold(0),
+			compression(false)
+		{
+		}
+
+		/**
+		Split binary data into content-defined chunks instead of spans of
+		fixed length. Chunk boundaries are selected by a gear hash of the
+		preceding bytes, so inserted or removed bytes shift only the nearby
+		boundaries. Default is off.
+		*/
+		bool binaryChunking;
+
+		/**
+		Fingerprints of data of at least this size keep only the span hashes
+		selected by a fixed rule (one of sampleRate() hash values), so their
+		memory use and compare() time stay bounded. Zero disables sampling,
+		this is the default.
+		*/
+		uint64_t samplingThreshold;
+
+		/**
+		Keep sparse fingerprints compressed: hash deltas and counts as
+		varints, 2-3 bytes per entry instead of 12. compare() decodes them on
+		the fly. Default is off.
+		*/
+		bool compression;
+	};
+
+	/**
+	Incremental fingerprint construction from arbitrary chunks of data.
+	Produces the same fingerprint as init() would produce for the
+	concatenation of all chunks.
+	*/
+	class Builder
+	{
+	public:
+		Builder(bool binary, const Options& options);
+
+		bool isBinary() const
+		{
+			return binary_;
+		}
+
+		/**
+		Check if spans are content-defined chunks, see
+		Options::binaryChunking.
+		*/
+		bool isChunked() const
+		{
+			return chunked_;
+		}
+
+		void update(const void* data, size_t size);
+		SpanHash finish();
+
+		/**
+		Save and restore complete builder state including the pending
+		partial span, so data can be appended later.
+		*/
+		void save(std::ostream& out) const;
+		bool load(std::istream& in);
+
+	private:
+		Options options_;
+		bool binary_;
+		bool chunked_;
+		Hasher hasher_;
+		unsigned spanLength_;
+		bool pendingCR_; // CR at the end of previous chunk, its meaning depends on the next byte
+		uint64_t gear_; // rolling hash that selects chunk boundaries
+		size_t size_;
+		Entries entries_;
+
+		/**
+		Fingerprint kernel specialized for line ending normalization and
+		span boundary selection, chosen once per update() call.
+		*/
+		template<typename LineEndings, typename Spans>
+		void run(const unsigned char* p, const unsigned char* end);
+
+		void addSpan(Hasher::Hash hash, unsigned length);
+
+	};
+
 	SpanHash();
+
+	/**
+	Non-owning fingerprint over external memory (for example a mapped index
+	file) that must outlive this object. `hashes` must be sorted.
+	*/
+	SpanHash(size_t size, const Hasher::Hash* hashes, const Count* counts, size_t count, unsigned sampleRate = 1);
+
 	SpanHash(SpanHash&& that);
 
 	SpanHash& operator=(SpanHash&& that);
 
 	bool isValid() const;
 	bool isEmpty() const;
-	bool init(const char* fileName, bool binary);
+	bool init(const char* fileName, bool binary, const Options& options);
+	void init(const void* data, size_t size, bool binary, const Options& options);
 	void clear();
-	
+
+	/**
+	Number of bytes the fingerprint was built from (after CR/LF folding).
+	*/
+	size_t size() const
+	{
+		return size_;
+	}
+
+	/**
+	Number of distinct span hashes. This is the amount of work done by
+	compare() when called on this object.
+	*/
+	size_t entryCount() const;
+
+	/**
+	Only hashes divisible by this number are kept, 1 if the fingerprint is
+	not sampled.
+	*/
+	unsigned sampleRate() const
+	{
+		return sampleRate_;
+	}
+
+	/**
+	Fingerprints with many distinct hashes are stored densely: a count for
+	each of Hasher::HASH_COUNT hash values, in 32 bits. This takes less
+	memory than sorted entries once a third of hash values are used and
+	lets compare() use vectorized kernels.
+	*/
+	bool isDense() const
+	{
+		return dense_ != nullptr;
+	}
+
+	const uint32_t* dense() const
+	{
+		return dense_;
+	}
+
+	/**
+	Compressed entries: for each hash in ascending order its difference from
+	the previous one (from 0 for the first one) and its count as varints.
+	*/
+	bool isCompressed() const
+	{
+		return compressed_ != nullptr;
+	}
+
+	const uint8_t* compressed() const
+	{
+		return compressed_;
+	}
+
+	size_t compressedSize() const
+	{
+		return compressedSize_;
+	}
+
+	/**
+	Span hashes in ascending order and their counts, entryCount() each.
+	Available for uncompressed sparse fingerprints only, see entries()
+	otherwise.
+	*/
+	const Hasher::Hash* hashes() const
+	{
+		return hashes_;
+	}
+
+	const Count* counts() const
+	{
+		return counts_;
+	}
+
+	/**
+	Copy sorted span hashes and their counts regardless of representation.
+	*/
+	void entries(std::vector<Hasher::Hash>& hashes, std::vector<Count>& counts) const;
+
+	/**
+	Copy keeping only the span hashes selected by the sampling rule. Its
+	size is the total count of kept hashes scaled by the sample rate, so
+	compare() of two samples estimates compare() of the original
+	fingerprints by the share of common spans among the sampled ones, at a
+	fraction of the cost.
+	*/
+	SpanHash sample() const;
+
+	/**
+	Approximate memory used by fingerprint entries in bytes.
+	*/
+	size_t memoryUsage() const;
+
+	/**
+	Upper bound of compare(that) from span length totals per hash bucket,
+	takes a few hundred operations regardless of fingerprint sizes. Pairs
+	below the similarity limit can be discarded without compare(). Non-owning
+	fingerprints have no bucket totals, their bound is 1.
+	*/
+	float maxSimilarity(const SpanHash& that) const;
+
+	/**
+	If any of fingerprints is sampled, only hashes selected by the sampling
+	rule are compared and the copied amount is scaled by the sample rate,
+	so the result is an unbiased estimate of the exact similarity (capped at
+	1).
+	*/
 	float compare(const SpanHash& that) const;
 	
 private:
-	typedef std::unordered_map<Hasher::Hash, size_t> Entries;
-
 	bool valid_;
 	size_t size_;
-	Entries entries_;
+	unsigned sampleRate_;
+	std::vector<Hasher::Hash> hashStorage_;
+	std::vector<Count> countStorage_;
+	std::vector<uint32_t> denseStorage_;
+	std::vector<uint8_t> compressedStorage_;
+	const Hasher::Hash* hashes_;
+	const Count* counts_;
+	const uint32_t* dense_;
+	const uint8_t* compressed_;
+	size_t compressedSize_;
+	size_t entryCount_;
+	std::vector<uint16_t> sketch_; // span length totals per bucket in units of 2^sketchShift_, rounded up
+	unsigned sketchShift_;
+
+	void assign(std::vector<Hasher::Hash>&& hashes, std::vector<Count>&& counts, bool compress);
+	void buildSketch();
 
 };
 
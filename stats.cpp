@@ -0,0 +1,327 @@
+#include "stats.hpp"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+
+namespace
+{
+
+	typedef std::chrono::steady_clock clock;
+
+	struct StepRecord
+	{
+		StepRecord():
+			title(),
+			wallTime(0),
+			cpuTime(0),
+			counters(),
+			peaks()
+		{
+		}
+
+		std::string title;
+		uint64_t wallTime;
+		uint64_t cpuTime;
+		uint64_t counters[Stats::CounterCount];
+		int64_t peaks[Stats::GaugeCount];
+	};
+
+	const char* const s_counterNames[Stats::CounterCount] =
+	{
+		"files_read",
+		"files_shared",
+		"bytes_read",
+		"sha1_bytes",
+		"sha1_time",
+		"span_hash_builds",
+		"span_hash_bytes",
+		"span_hash_time",
+		"candidate_pairs",
+		"size_pruned_pairs",
+		"sketch_pruned_pairs",
+		"approx_pruned_pairs",
+		"approx_accepted_pairs",
+		"bound_pruned_pairs",
+		"compare_calls",
+		"compare_work",
+		"compare_time",
+		"async_tasks",
+		"async_blocked_time",
+		"worker_wait_time",
+		"sync_wait_time",
+		"sync_tasks"
+	};
+
+	const char* const s_gaugeNames[Stats::GaugeCount] =
+	{
+		"peak_fingerprint_memory",
+		"peak_path_memory",
+		"peak_async_queue_depth"
+	};
+
+	std::atomic<bool> s_enabled(false);
+	std::atomic<uint64_t> s_counters[Stats::CounterCount];
+	std::atomic<int64_t> s_gauges[Stats::GaugeCount];
+	std::atomic<int64_t> s_peaks[Stats::GaugeCount];
+
+	std::mutex s_stepsMutex;
+	std::vector<StepRecord> s_steps;
+	bool s_stepActive = false;
+	StepRecord s_current;
+	clock::time_point s_stepStart;
+	uint64_t s_stepCpuStart = 0;
+	uint64_t s_stepCounters[Stats::CounterCount];
+
+	uint64_t cpuTime()
+	{
+		rusage usage;
+		if(getrusage(RUSAGE_SELF, &usage) != 0)
+		{
+			return 0;
+		}
+
+		const uint64_t us =
+			(static_cast<uint64_t>(usage.ru_utime.tv_sec) + usage.ru_stime.tv_sec) * 1000000 +
+			usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+
+		return us * 1000;
+	}
+
+	double seconds(uint64_t ns)
+	{
+		return static_cast<double>(ns) / 1e9;
+	}
+
+	double throughput(uint64_t bytes, uint64_t ns)
+	{
+		return ns > 0 ? static_cast<double>(bytes) / seconds(ns) : 0.0;
+	}
+
+	void writeString(std::ostream& out, const std::string& s)
+	{
+		out << '"';
+		for(char c: s)
+		{
+			switch(c)
+			{
+			case '"':
+				out << "\\\"";
+				break;
+
+			case '\\':
+				out << "\\\\";
+				break;
+
+			case '\n':
+				out << "\\n";
+				break;
+
+			default:
+				out << c;
+				break;
+			}
+		}
+		out << '"';
+	}
+
+	void writeStep(std::ostream& out, const StepRecord& step, const char* indent)
+	{
+		const uint64_t* c = step.counters;
+
+		out << indent << "{\n";
+		out << indent << "\t\"title\": ";
+		writeString(out, step.title);
+		out << ",\n";
+		out << indent << "\t\"wall_time\": " << seconds(step.wallTime) << ",\n";
+		out << indent << "\t\"cpu_time\": " << seconds(step.cpuTime) << ",\n";
+
+		for(size_t i = 0; i != Stats::CounterCount; ++i)
+		{
+			out << indent << "\t\"" << s_counterNames[i] << "\": ";
+
+			// time counters are reported in seconds
+			switch(i)
+			{
+			case Stats::Sha1Time:
+			case Stats::SpanHashTime:
+			case Stats::CompareTime:
+			case Stats::AsyncBlockedTime:
+			case Stats::WorkerWaitTime:
+			case Stats::SyncWaitTime:
+				out << seconds(c[i]);
+				break;
+
+			default:
+				out << c[i];
+				break;
+			}
+
+			out << ",\n";
+		}
+
+		for(size_t i = 0; i != Stats::GaugeCount; ++i)
+		{
+			out << indent << "\t\"" << s_gaugeNames[i] << "\": " << step.peaks[i] << ",\n";
+		}
+
+		out << indent << "\t\"sha1_throughput\": " << throughput(c[Stats::Sha1Bytes], c[Stats::Sha1Time]) << ",\n";
+		out << indent << "\t\"span_hash_throughput\": " << throughput(c[Stats::SpanHashBytes], c[Stats::SpanHashTime]) << "\n";
+		out << indent << "}";
+	}
+
+}
+
+
+namespace Stats
+{
+
+	void setEnabled(bool v)
+	{
+		s_enabled.store(v, std::memory_order_relaxed);
+	}
+
+	bool isEnabled()
+	{
+		return s_enabled.load(std::memory_order_relaxed);
+	}
+
+	void add(Counter counter, uint64_t value)
+	{
+		if(!isEnabled())
+		{
+			return;
+		}
+
+		s_counters[counter].fetch_add(value, std::memory_order_relaxed);
+	}
+
+	void adjust(Gauge gauge, int64_t delta)
+	{
+		if(!isEnabled())
+		{
+			return;
+		}
+
+		const int64_t v = s_gauges[gauge].fetch_add(delta, std::memory_order_relaxed) + delta;
+
+		int64_t peak = s_peaks[gauge].load(std::memory_order_relaxed);
+		while(v > peak && !s_peaks[gauge].compare_exchange_weak(peak, v, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	void beginStep(const char* title)
+	{
+		if(!isEnabled())
+		{
+			return;
+		}
+
+		endStep();
+
+		std::lock_guard<std::mutex> lock(s_stepsMutex);
+
+		s_stepActive = true;
+		s_current = StepRecord();
+		s_current.title = title;
+		s_stepStart = clock::now();
+		s_stepCpuStart = cpuTime();
+
+		for(size_t i = 0; i != CounterCount; ++i)
+		{
+			s_stepCounters[i] = s_counters[i].load(std::memory_order_relaxed);
+		}
+
+		// peaks are tracked from the current value
+		for(size_t i = 0; i != GaugeCount; ++i)
+		{
+			s_peaks[i].store(s_gauges[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+		}
+	}
+
+	void endStep()
+	{
+		if(!isEnabled())
+		{
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(s_stepsMutex);
+
+		if(!s_stepActive)
+		{
+			return;
+		}
+
+		s_stepActive = false;
+
+		s_current.wallTime = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - s_stepStart).count();
+		s_current.cpuTime = cpuTime() - s_stepCpuStart;
+
+		for(size_t i = 0; i != CounterCount; ++i)
+		{
+			s_current.counters[i] = s_counters[i].load(std::memory_order_relaxed) - s_stepCounters[i];
+		}
+
+		for(size_t i = 0; i != GaugeCount; ++i)
+		{
+			s_current.peaks[i] = s_peaks[i].load(std::memory_order_relaxed);
+		}
+
+		s_steps.push_back(s_current);
+	}
+
+	bool write(const std::string& fileName)
+	{
+		endStep();
+
+		std::ofstream out(fileName, std::ios_base::out | std::ios_base::trunc);
+		if(!out.is_open())
+		{
+			std::cerr << "ERROR: failed to open file: '" << fileName << "'" << std::endl;
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lock(s_stepsMutex);
+
+		StepRecord total;
+		total.title = "total";
+
+		out << "{\n";
+		out << "\t\"steps\": [\n";
+		for(size_t i = 0; i != s_steps.size(); ++i)
+		{
+			const auto& step = s_steps[i];
+
+			writeStep(out, step, "\t\t");
+			out << (i + 1 != s_steps.size() ? ",\n" : "\n");
+
+			total.wallTime += step.wallTime;
+			total.cpuTime += step.cpuTime;
+
+			for(size_t j = 0; j != CounterCount; ++j)
+			{
+				total.counters[j] += step.counters[j];
+			}
+
+			for(size_t j = 0; j != GaugeCount; ++j)
+			{
+				total.peaks[j] = std::max(total.peaks[j], step.peaks[j]);
+			}
+		}
+		out << "\t],\n";
+		out << "\t\"total\":\n";
+		writeStep(out, total, "\t");
+		out << "\n}\n";
+
+		return out.good();
+	}
+
+}
@@ -0,0 +1,120 @@
+#ifndef STATS_HPP_INCLUDED
+#define STATS_HPP_INCLUDED
+
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+
+#include <string>
+#include <chrono>
+
+
+namespace Stats
+{
+
+	/**
+	Monotonic counters. Values are accumulated per step, times are in
+	nanoseconds.
+	*/
+	enum Counter
+	{
+		FilesRead,
+		FilesShared,
+		BytesRead,
+		Sha1Bytes,
+		Sha1Time,
+		SpanHashBuilds,
+		SpanHashBytes,
+		SpanHashTime,
+		CandidatePairs,
+		SizePrunedPairs,
+		SketchPrunedPairs,
+		ApproxPrunedPairs,
+		ApproxAcceptedPairs,
+		BoundPrunedPairs,
+		CompareCalls,
+		CompareWork,
+		CompareTime,
+		AsyncTasks,
+		AsyncBlockedTime,
+		WorkerWaitTime,
+		SyncWaitTime,
+		SyncTasks,
+
+		CounterCount
+	};
+
+	/**
+	Gauges track current value and its peak within a step.
+	*/
+	enum Gauge
+	{
+		FingerprintMemory,
+		PathMemory,
+		AsyncQueueDepth,
+
+		GaugeCount
+	};
+
+	/**
+	Statistics are collected only when enabled. Disabled statistics cost a
+	single relaxed atomic load per call.
+	*/
+	void setEnabled(bool v);
+	bool isEnabled();
+
+	void add(Counter counter, uint64_t value = 1);
+	void adjust(Gauge gauge, int64_t delta);
+
+	/**
+	Start new step. Previous step is finished implicitly.
+	*/
+	void beginStep(const char* title);
+
+	/**
+	Finish current step and record its counters.
+	*/
+	void endStep();
+
+	/**
+	Write JSON report with all finished steps to the given file.
+	*/
+	bool write(const std::string& fileName);
+
+	/**
+	Scoped timer that adds elapsed time to the given counter.
+	*/
+	class Timer
+	{
+	public:
+		explicit Timer(Counter counter):
+			counter_(counter),
+			enabled_(isEnabled()),
+			start_(enabled_ ? clock::now() : clock::time_point())
+		{
+		}
+
+		~Timer()
+		{
+			if(enabled_)
+			{
+				add(counter_, std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start_).count());
+			}
+		}
+
+		Timer(const Timer&) = delete;
+		Timer& operator=(const Timer&) = delete;
+
+	private:
+		typedef std::chrono::steady_clock clock;
+
+		Counter counter_;
+		bool enabled_;
+		clock::time_point start_;
+
+	};
+
+}
+
+
+#endif
@@ -0,0 +1,213 @@
+#include "trace.hpp"
+
+#ifdef SIMILAR_TRACE
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+
+namespace
+{
+
+	struct Event
+	{
+		const char* name;
+		uint64_t begin;
+		uint64_t end;
+	};
+
+	class Buffer
+	{
+	public:
+		// 64K events per thread, older events are overwritten
+		static const size_t CAPACITY = 1 << 16;
+
+		explicit Buffer(unsigned id):
+			id_(id),
+			name_(),
+			count_(0),
+			events_(CAPACITY)
+		{
+		}
+
+		unsigned id() const
+		{
+			return id_;
+		}
+
+		const std::string& name() const
+		{
+			return name_;
+		}
+
+		void setName(const char* name)
+		{
+			name_ = name;
+		}
+
+		void push(const char* name, uint64_t begin, uint64_t end)
+		{
+			const size_t n = count_.load(std::memory_order_relaxed);
+			Event& e = events_[n % CAPACITY];
+			e.name = name;
+			e.begin = begin;
+			e.end = end;
+			count_.store(n + 1, std::memory_order_release);
+		}
+
+		template<typename F>
+		void forEach(F f) const
+		{
+			const size_t n = count_.load(std::memory_order_acquire);
+			const size_t first = n > CAPACITY ? n - CAPACITY : 0;
+			for(size_t i = first; i != n; ++i)
+			{
+				f(events_[i % CAPACITY]);
+			}
+		}
+
+	private:
+		unsigned id_;
+		std::string name_;
+		std::atomic<size_t> count_;
+		std::vector<Event> events_;
+
+	};
+
+	std::atomic<bool> s_enabled(false);
+
+	// buffers outlive their threads so spans of finished threads are dumped too
+	std::mutex s_buffersMutex;
+	std::vector<std::shared_ptr<Buffer>> s_buffers;
+
+	Buffer& threadBuffer()
+	{
+		thread_local std::shared_ptr<Buffer> buffer;
+		if(!buffer)
+		{
+			std::lock_guard<std::mutex> lock(s_buffersMutex);
+			buffer = std::make_shared<Buffer>(s_buffers.size() + 1);
+			s_buffers.push_back(buffer);
+		}
+
+		return *buffer;
+	}
+
+	void writeString(std::ostream& out, const std::string& s)
+	{
+		out << '"';
+		for(char c: s)
+		{
+			if(c == '"' || c == '\\')
+			{
+				out << '\\';
+			}
+			out << c;
+		}
+		out << '"';
+	}
+
+}
+
+
+namespace Trace
+{
+
+	void setEnabled(bool v)
+	{
+		s_enabled.store(v, std::memory_order_relaxed);
+	}
+
+	bool isEnabled()
+	{
+		return s_enabled.load(std::memory_order_relaxed);
+	}
+
+	void setThreadName(const char* name)
+	{
+		threadBuffer().setName(name);
+	}
+
+	void record(const char* name, uint64_t begin, uint64_t end)
+	{
+		threadBuffer().push(name, begin, end);
+	}
+
+	uint64_t now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	bool write(const std::string& fileName)
+	{
+		std::ofstream out(fileName, std::ios_base::out | std::ios_base::trunc);
+		if(!out.is_open())
+		{
+			std::cerr << "ERROR: failed to open file: '" << fileName << "'" << std::endl;
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lock(s_buffersMutex);
+
+		// timestamps are written relative to the earliest span
+		uint64_t origin = UINT64_MAX;
+		for(const auto& buffer: s_buffers)
+		{
+			buffer->forEach([&origin](const Event& e)
+			{
+				origin = std::min(origin, e.begin);
+			});
+		}
+
+		out.setf(std::ios_base::fixed, std::ios_base::floatfield);
+		out.precision(3);
+
+		out << "{\"traceEvents\":[\n";
+
+		bool first = true;
+		auto separator = [&]
+		{
+			if(!first)
+			{
+				out << ",\n";
+			}
+			first = false;
+		};
+
+		for(const auto& buffer: s_buffers)
+		{
+			if(!buffer->name().empty())
+			{
+				separator();
+				out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << buffer->id() << ",\"args\":{\"name\":";
+				writeString(out, buffer->name());
+				out << "}}";
+			}
+
+			buffer->forEach([&](const Event& e)
+			{
+				separator();
+				out << "{\"ph\":\"X\",\"name\":";
+				writeString(out, e.name);
+				out
+					<< ",\"pid\":1,\"tid\":" << buffer->id()
+					<< ",\"ts\":" << (e.begin - origin) / 1000.0
+					<< ",\"dur\":" << (e.end - e.begin) / 1000.0
+					<< "}";
+			});
+		}
+
+		out << "\n]}\n";
+
+		return out.good();
+	}
+
+}
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef TRACE_HPP_INCLUDED
+#define TRACE_HPP_INCLUDED
+
+
+/**
+Timeline tracing of worker threads and pipeline stages.
+
+Tracing is compiled in only when SIMILAR_TRACE is defined (see SIMILAR_TRACE
+CMake option). Otherwise TRACE_SCOPE() and TRACE_THREAD_NAME() expand to
+nothing.
+
+Each thread records completed spans into its own ring buffer, so recording
+doesn't take any locks. The buffers are dumped in Chrome trace event format
+which can be opened with chrome://tracing or https://ui.perfetto.dev.
+*/
+
+
+#ifdef SIMILAR_TRACE
+
+
+#include <string>
+#include <chrono>
+#include <stdint.h>
+
+
+namespace Trace
+{
+
+	void setEnabled(bool v);
+	bool isEnabled();
+
+	/**
+	Name calling thread in the trace.
+	*/
+	void setThreadName(const char* name);
+
+	/**
+	Record span [begin, end] in the calling thread's ring buffer.
+	`name` must point to a string with static storage duration.
+	*/
+	void record(const char* name, uint64_t begin, uint64_t end);
+
+	/**
+	Current trace timestamp in nanoseconds.
+	*/
+	uint64_t now();
+
+	/**
+	Write all recorded spans to the given file in Chrome trace JSON format.
+	*/
+	bool write(const std::string& fileName);
+
+	class Scope
+	{
+	public:
+		explicit Scope(const char* name):
+			name_(name),
+			begin_(isEnabled() ? now() : 0)
+		{
+		}
+
+		~Scope()
+		{
+			if(begin_ != 0)
+			{
+				record(name_, begin_, now());
+			}
+		}
+
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+	private:
+		const char* name_;
+		uint64_t begin_;
+
+	};
+
+}
+
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+
+#define TRACE_SCOPE(name) Trace::Scope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_THREAD_NAME(name) Trace::setThreadName(name)
+
+
+#else
+
+
+#define TRACE_SCOPE(name)
+#define TRACE_THREAD_NAME(name)
+
+
+#endif
+
+
+#endif
@@ -0,0 +1,381 @@
+#include "watch_index.hpp"
+#include "directory.hpp"
+
+#include <algorithm>
+
+
+namespace
+{
+
+	bool isUnder(const std::string& path, const std::string& root)
+	{
+		if(path.compare(0, root.size(), root) != 0)
+		{
+			return false;
+		}
+
+		return path.size() == root.size() || path[root.size()] == '/';
+	}
+
+	bool isUnderAny(const std::string& path, const std::set<std::string>& roots)
+	{
+		for(const auto& root: roots)
+		{
+			if(isUnder(path, root))
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	std::string stripTrailingSlashes(const std::string& path)
+	{
+		size_t len = path.size();
+		while(len > 1 && (path[len - 1] == '/' || path[len - 1] == '\\'))
+		{
+			len -= 1;
+		}
+
+		return path.substr(0, len);
+	}
+
+	Matcher::Options captureOptions(Matcher::Options options, FingerprintCache& cache)
+	{
+		// all similar pairs are kept since exact matches may change later
+		options.all = true;
+		options.cache = &cache;
+		return options;
+	}
+
+}
+
+
+WatchIndex::WatchIndex(FileList& source, FileList& destination, FingerprintCache& cache, const Matcher::Options& options, bool followSymlinks):
+	source_(source),
+	destination_(destination),
+	cache_(cache),
+	options_(options),
+	followSymlinks_(followSymlinks),
+	roots_(),
+	watcher_(),
+	matcher_(source, destination, captureOptions(options, cache)),
+	edges_()
+{
+	options_.cache = &cache;
+
+	matcher_.setMatchCallback([this](float similarity, const FileInfo& src, const FileInfo& dst)
+	{
+		recordEdge(similarity, src, dst);
+	});
+}
+
+
+void WatchIndex::addRoot(const std::string& path, bool source)
+{
+	roots_.emplace_back(stripTrailingSlashes(path), source);
+}
+
+
+bool WatchIndex::watch()
+{
+	if(!watcher_.isValid())
+	{
+		return false;
+	}
+
+	bool result = true;
+	for(const auto& root: roots_)
+	{
+		const Directory::Stat stat(root.path.c_str(), followSymlinks_);
+		if(stat.fileType == Directory::Stat::Directory)
+		{
+			result &= watcher_.addTree(root.path);
+		}
+		else
+		{
+			// watch the parent to see the file replaced or recreated
+			const size_t slash = root.path.rfind('/');
+			const std::string parent = (slash == std::string::npos) ? "." : root.path.substr(0, std::max<size_t>(slash, 1));
+			result &= watcher_.addDirectory(parent);
+		}
+	}
+
+	return result;
+}
+
+
+void WatchIndex::build()
+{
+	edges_.clear();
+
+	matcher_.hash();
+
+	if(!matcher_.isExactOnly())
+	{
+		matcher_.findSimilarFiles();
+	}
+}
+
+
+void WatchIndex::report(const Matcher::MatchCallback& callback)
+{
+	std::unordered_map<std::string, size_t> destinationPositions;
+	destinationPositions.reserve(destination_.size());
+	for(size_t i = 0; i != destination_.size(); ++i)
+	{
+		destinationPositions[destination_[i].name()] = i;
+	}
+
+	// similar destinations of the given source in destination list order
+	auto sourceEdges = [&](const FileInfo& src)
+	{
+		std::vector<std::pair<size_t, float>> result;
+
+		auto edges = edges_.find(src.name());
+		if(edges != edges_.end())
+		{
+			for(const auto& edge: edges->second)
+			{
+				auto pos = destinationPositions.find(edge.first);
+				if(pos != destinationPositions.end())
+				{
+					result.emplace_back(pos->second, edge.second);
+				}
+			}
+		}
+
+		std::sort(result.begin(), result.end());
+		return result;
+	};
+
+	matcher_.setOptions(options_);
+	matcher_.setMatchCallback(callback);
+
+	if(options_.all)
+	{
+		matcher_.findExactMatches();
+
+		for(const auto& src: source_)
+		{
+			for(const auto& edge: sourceEdges(src))
+			{
+				callback(edge.second, src, destination_[edge.first]);
+			}
+		}
+	}
+	else
+	{
+		matcher_.findExactMatches();
+
+		for(size_t i = 0; i != source_.size(); ++i)
+		{
+			for(const auto& edge: sourceEdges(source_[i]))
+			{
+				// in self comparison each pair is stored in both directions
+				if(!isSelfCompare() || i < edge.first)
+				{
+					matcher_.addMatch(i, edge.first, edge.second);
+				}
+			}
+		}
+
+		matcher_.dumpMatches();
+	}
+
+	matcher_.setOptions(captureOptions(options_, cache_));
+	matcher_.setMatchCallback([this](float similarity, const FileInfo& src, const FileInfo& dst)
+	{
+		recordEdge(similarity, src, dst);
+	});
+}
+
+
+bool WatchIndex::update(int timeoutMs)
+{
+	Watcher::Events events;
+	if(!watcher_.wait(events, timeoutMs))
+	{
+		return false;
+	}
+
+	Names changed;
+	Names removed;
+	Names removedDirs;
+
+	// later events override earlier ones
+	for(const auto& e: events)
+	{
+		if(e.type == Watcher::Event::Removed)
+		{
+			changed.erase(e.path);
+			(e.directory ? removedDirs : removed).insert(e.path);
+		}
+		else
+		{
+			removed.erase(e.path);
+			changed.insert(e.path);
+		}
+	}
+
+	Names affected;
+	apply(source_, true, changed, removed, removedDirs, affected);
+	if(!isSelfCompare())
+	{
+		apply(destination_, false, changed, removed, removedDirs, affected);
+	}
+
+	if(affected.empty())
+	{
+		return false;
+	}
+
+	// removed files are gone from both lists, their fingerprints aren't needed
+	for(const auto& name: affected)
+	{
+		if(removed.count(name) || isUnderAny(name, removedDirs))
+		{
+			cache_.remove(name);
+		}
+	}
+
+	// forget pairs with affected files
+	for(auto it = edges_.begin(); it != edges_.end(); )
+	{
+		if(affected.count(it->first))
+		{
+			it = edges_.erase(it);
+			continue;
+		}
+
+		auto& dsts = it->second;
+		for(auto dst = dsts.begin(); dst != dsts.end(); )
+		{
+			if(affected.count(dst->first))
+			{
+				dst = dsts.erase(dst);
+			}
+			else
+			{
+				++dst;
+			}
+		}
+
+		++it;
+	}
+
+	// unchanged files are taken from the cache
+	matcher_.hash();
+
+	compare(affected);
+
+	return true;
+}
+
+
+bool WatchIndex::covers(bool source, const std::string& path) const
+{
+	for(const auto& root: roots_)
+	{
+		if((root.source == source || isSelfCompare()) && isUnder(path, root.path))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+void WatchIndex::apply(FileList& list, bool source, const Names& changed, const Names& removed, const Names& removedDirs, Names& affected)
+{
+	FileList result;
+	result.reserve(list.size() + changed.size());
+
+	Names seen;
+
+	// keep positions of changed files in the list
+	for(auto& fi: list)
+	{
+		const std::string& name = fi.name();
+
+		if(changed.count(name))
+		{
+			seen.insert(name);
+			affected.insert(name);
+
+			const Directory::Stat stat(name.c_str(), followSymlinks_);
+			if(stat.fileType == Directory::Stat::Regular)
+			{
+				result.emplace_back(name, stat.size);
+			}
+
+			continue;
+		}
+
+		if(removed.count(name) || isUnderAny(name, removedDirs))
+		{
+			affected.insert(name);
+			continue;
+		}
+
+		result.push_back(std::move(fi));
+	}
+
+	// new files
+	for(const auto& name: changed)
+	{
+		if(seen.count(name) || !covers(source, name))
+		{
+			continue;
+		}
+
+		const Directory::Stat stat(name.c_str(), followSymlinks_);
+		if(stat.fileType == Directory::Stat::Regular)
+		{
+			affected.insert(name);
+			result.emplace_back(name, stat.size);
+		}
+	}
+
+	list.swap(result);
+}
+
+
+void WatchIndex::compare(const Names& affected)
+{
+	if(matcher_.isExactOnly())
+	{
+		return;
+	}
+
+	std::vector<size_t> affectedSources;
+	std::vector<size_t> otherSources;
+	for(size_t i = 0; i != source_.size(); ++i)
+	{
+		(affected.count(source_[i].name()) ? affectedSources : otherSources).push_back(i);
+	}
+
+	std::vector<size_t> affectedDestinations;
+	std::vector<size_t> allDestinations;
+	for(size_t i = 0; i != destination_.size(); ++i)
+	{
+		if(affected.count(destination_[i].name()))
+		{
+			affectedDestinations.push_back(i);
+		}
+
+		allDestinations.push_back(i);
+	}
+
+	// each pair with at least one affected file is compared once
+	matcher_.findSimilarFiles(affectedSources, allDestinations);
+	matcher_.findSimilarFiles(otherSources, affectedDestinations);
+}
+
+
+void WatchIndex::recordEdge(float similarity, const FileInfo& source, const FileInfo& destination)
+{
+	edges_[source.name()][destination.name()] = similarity;
+}
@@ -0,0 +1,100 @@
+#ifndef WATCH_INDEX_HPP_INCLUDED
+#define WATCH_INDEX_HPP_INCLUDED
+
+
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+
+#include "file_info.hpp"
+#include "fingerprint_cache.hpp"
+#include "matcher.hpp"
+#include "watcher.hpp"
+
+
+/**
+Long-running similarity index kept up to date with file system changes.
+
+File lists, digests and fingerprints stay in memory together with all
+similar pairs found so far. When files change only they are re-read and
+compared again, results for the other pairs are reused.
+*/
+class WatchIndex
+{
+public:
+	/**
+	`destination` may refer to the same list as `source`. Lists and cache
+	must outlive the index.
+	*/
+	WatchIndex(FileList& source, FileList& destination, FingerprintCache& cache, const Matcher::Options& options, bool followSymlinks);
+
+	/**
+	Add file or directory the lists were populated from. Changes inside it
+	are applied to source or destination list respectively.
+	*/
+	void addRoot(const std::string& path, bool source);
+
+	/**
+	Start watching all directory roots.
+	*/
+	bool watch();
+
+	/**
+	Hash all files and compare them.
+	*/
+	void build();
+
+	/**
+	Report current matches the same way Matcher reports them.
+	*/
+	void report(const Matcher::MatchCallback& callback);
+
+	/**
+	Wait up to `timeoutMs` milliseconds (-1 for infinite wait) for file
+	changes and apply them. Returns true if any file changed.
+	*/
+	bool update(int timeoutMs);
+
+private:
+	struct Root
+	{
+		Root(const std::string& path, bool source):
+			path(path),
+			source(source)
+		{
+		}
+
+		std::string path;
+		bool source;
+	};
+
+	typedef std::set<std::string> Names;
+
+	// source name -> destination name -> similarity
+	typedef std::unordered_map<std::string, std::unordered_map<std::string, float>> Edges;
+
+	FileList& source_;
+	FileList& destination_;
+	FingerprintCache& cache_;
+	Matcher::Options options_;
+	bool followSymlinks_;
+	std::vector<Root> roots_;
+	Watcher watcher_;
+	Matcher matcher_;
+	Edges edges_;
+
+	bool isSelfCompare() const
+	{
+		return &source_ == &destination_;
+	}
+
+	bool covers(bool source, const std::string& path) const;
+	void apply(FileList& list, bool source, const Names& changed, const Names& removed, const Names& removedDirs, Names& affected);
+	void compare(const Names& affected);
+	void recordEdge(float similarity, const FileInfo& source, const FileInfo& destination);
+
+};
+
+
+#endif
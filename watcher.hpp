@@ -0,0 +1,74 @@
+#ifndef WATCHER_HPP_INCLUDED
+#define WATCHER_HPP_INCLUDED
+
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+
+/**
+Watch directory trees for file changes.
+*/
+class Watcher
+{
+public:
+	struct Event
+	{
+		enum Type
+		{
+			Changed, // file was written, created or moved in
+			Removed  // file or directory was deleted or moved out
+		};
+
+		Event(Type type, const std::string& path, bool directory):
+			type(type),
+			path(path),
+			directory(directory)
+		{
+		}
+
+		Type type;
+		std::string path;
+		bool directory;
+	};
+
+	typedef std::vector<Event> Events;
+
+	Watcher();
+	~Watcher();
+
+	Watcher(const Watcher&) = delete;
+	Watcher& operator=(const Watcher&) = delete;
+
+	bool isValid() const;
+
+	/**
+	Watch the given directory and all its subdirectories.
+	Directories created later inside watched ones are watched automatically,
+	regular files found inside them are reported as changed.
+	*/
+	bool addTree(const std::string& path);
+
+	/**
+	Watch the given directory without its subdirectories.
+	*/
+	bool addDirectory(const std::string& path);
+
+	/**
+	Wait up to `timeoutMs` milliseconds (-1 for infinite wait) for changes.
+	Events arriving shortly after the first one are collected into the same
+	batch. Returns false on timeout or error.
+	*/
+	bool wait(Events& events, int timeoutMs);
+
+private:
+	int fd_;
+	std::unordered_map<int, std::string> watches_;
+
+	void read(Events& events);
+
+};
+
+
+#endif
@@ -0,0 +1,205 @@
+#include "watcher.hpp"
+#include "directory_walker.hpp"
+
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <iostream>
+
+
+namespace
+{
+
+	const uint32_t WATCH_MASK =
+		IN_CLOSE_WRITE |
+		IN_CREATE |
+		IN_DELETE |
+		IN_MOVED_FROM |
+		IN_MOVED_TO |
+		IN_DELETE_SELF |
+		IN_MOVE_SELF;
+
+	// events arriving within this interval are joined into one batch
+	const int BATCH_INTERVAL_MS = 200;
+
+	// but a batch is never collected longer than this
+	const int MAX_BATCH_MS = 2000;
+
+}
+
+
+Watcher::Watcher():
+	fd_(inotify_init1(IN_CLOEXEC)),
+	watches_()
+{
+	if(fd_ < 0)
+	{
+		std::cerr << "ERROR: failed to initialize inotify" << std::endl;
+	}
+}
+
+
+Watcher::~Watcher()
+{
+	if(fd_ >= 0)
+	{
+		close(fd_);
+	}
+}
+
+
+bool Watcher::isValid() const
+{
+	return fd_ >= 0;
+}
+
+
+bool Watcher::addTree(const std::string& path)
+{
+	if(!addDirectory(path))
+	{
+		return false;
+	}
+
+	for(auto f: DirectoryWalker(path.c_str(), false))
+	{
+		if(f.second.fileType == Directory::Stat::Directory)
+		{
+			addDirectory(f.first);
+		}
+	}
+
+	return true;
+}
+
+
+bool Watcher::wait(Events& events, int timeoutMs)
+{
+	if(fd_ < 0)
+	{
+		return false;
+	}
+
+	pollfd p;
+	p.fd = fd_;
+	p.events = POLLIN;
+	p.revents = 0;
+
+	int r = poll(&p, 1, timeoutMs);
+	if(r <= 0)
+	{
+		if(r < 0 && errno != EINTR)
+		{
+			std::cerr << "ERROR: failed to wait for file system events" << std::endl;
+		}
+
+		return false;
+	}
+
+	// collect all events of the batch
+	for(int elapsed = 0; elapsed < MAX_BATCH_MS; elapsed += BATCH_INTERVAL_MS)
+	{
+		read(events);
+
+		if(poll(&p, 1, BATCH_INTERVAL_MS) <= 0)
+		{
+			break;
+		}
+	}
+
+	return !events.empty();
+}
+
+
+bool Watcher::addDirectory(const std::string& path)
+{
+	if(fd_ < 0)
+	{
+		return false;
+	}
+
+	int wd = inotify_add_watch(fd_, path.c_str(), WATCH_MASK);
+	if(wd < 0)
+	{
+		std::cerr << "ERROR: failed to watch directory: '" << path << "'" << std::endl;
+		return false;
+	}
+
+	watches_[wd] = path;
+	return true;
+}
+
+
+void Watcher::read(Events& events)
+{
+	alignas(inotify_event) char buffer[64 * 1024];
+
+	ssize_t size = ::read(fd_, buffer, sizeof(buffer));
+	if(size <= 0)
+	{
+		return;
+	}
+
+	for(char* p = buffer; p < buffer + size; )
+	{
+		const inotify_event* e = reinterpret_cast<const inotify_event*>(p);
+		p += sizeof(inotify_event) + e->len;
+
+		if(e->mask & IN_Q_OVERFLOW)
+		{
+			std::cerr << "ERROR: file system event queue overflow, some changes are lost" << std::endl;
+			continue;
+		}
+
+		auto watch = watches_.find(e->wd);
+		if(watch == watches_.end())
+		{
+			continue;
+		}
+
+		if(e->mask & IN_IGNORED)
+		{
+			watches_.erase(watch);
+			continue;
+		}
+
+		if(e->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+		{
+			// reported by the parent directory
+			continue;
+		}
+
+		if(e->len == 0)
+		{
+			continue;
+		}
+
+		// keep paths in the same form as DirectoryWalker produces them
+		const std::string path = (watch->second == ".") ? std::string(e->name) : watch->second + '/' + e->name;
+		const bool directory = (e->mask & IN_ISDIR) != 0;
+
+		if(e->mask & (IN_DELETE | IN_MOVED_FROM))
+		{
+			events.emplace_back(Event::Removed, path, directory);
+		}
+		else if(directory && (e->mask & (IN_CREATE | IN_MOVED_TO)))
+		{
+			addTree(path);
+
+			// files could be created before the watch was added
+			for(auto f: DirectoryWalker(path.c_str(), false))
+			{
+				if(f.second.fileType == Directory::Stat::Regular)
+				{
+					events.emplace_back(Event::Changed, f.first, false);
+				}
+			}
+		}
+		else if(!directory && (e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+		{
+			events.emplace_back(Event::Changed, path, false);
+		}
+	}
+}